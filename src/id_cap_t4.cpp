@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <Arduino.h>
+#include <SD.h>
+#include "id_cap_t4.h"
+#include "id_con_t4.h"
+#include "id_mem_t4.h"
+
+extern "C"
+{
+#include "printf.h"
+#include "ck_cross.h"
+}
+
+static const int BAND_BYTES = CAP_T4_BAND_ROWS * CAP_T4_WIDTH / 2;
+static const int BANDS = CAP_T4_HEIGHT / CAP_T4_BAND_ROWS;
+//Worst case is nearly all literals, with a control byte for every 128
+static const int OUT_BYTES = sizeof(CAP_T4_FrameHeader) + BANDS * (BAND_BYTES + BAND_BYTES / 128 + 2);
+static const int SD_CHUNK = 4096;
+//Starting guesses for how long a band encode and an SD write take, until they have been measured
+static const uint32_t BAND_ESTIMATE_US = 200;
+static const uint32_t SD_WRITE_ESTIMATE_US = 1500;
+
+typedef enum CAP_T4_Target
+{
+    CAP_T4_SD,
+    CAP_T4_USB,
+} CAP_T4_Target;
+
+//Only allocated while capturing
+typedef struct CAP_T4_Buffers
+{
+    uint32_t crc_table[256];
+    uint8_t frame[CAP_T4_FRAME_BYTES]; //From present, waiting to be encoded
+    uint8_t last[CAP_T4_FRAME_BYTES];  //The last frame encoded
+    uint8_t delta[BAND_BYTES];
+    uint8_t out[OUT_BYTES];
+} CAP_T4_Buffers;
+
+static struct
+{
+    bool active; //Taking new frames. Cleared when stopping, while the last one is finished.
+    CAP_T4_Target target;
+    CAP_T4_Buffers *buf;
+    bool buf_in_extmem;
+    File file;
+    uint32_t start_ms;
+    uint32_t presented;
+
+    bool frame_ready; //buf->frame holds a frame that hasn't been fully encoded
+    int band;         //Next band of it to encode
+    uint32_t crc;
+    uint32_t pack_start;
+    CAP_T4_FrameHeader header;
+    int enc_len;          //Bytes of the frame being encoded in buf->out
+    int out_len, out_pos; //Bytes in buf->out ready to go, and how many have been written
+
+    //Recent slowest band encode and SD write, decaying. Work isn't started with less idle time left than these.
+    uint32_t band_us, write_us;
+
+    struct
+    {
+        uint32_t captured;
+        uint32_t skipped;
+        uint32_t keyframes;
+        uint32_t bytes;
+        uint32_t pack_cycles;
+        uint32_t encode_cycles;
+        uint32_t write_us_max;
+    } stats;
+} cap;
+
+bool CAP_T4_Active()
+{
+    return cap.active;
+}
+
+uint8_t *CAP_T4_BeginFrame()
+{
+    if (!cap.active)
+    {
+        return NULL;
+    }
+    cap.presented++;
+    if (cap.frame_ready)
+    {
+        cap.stats.skipped++;
+        return NULL;
+    }
+    cap.pack_start = ARM_DWT_CYCCNT;
+    return cap.buf->frame;
+}
+
+void CAP_T4_EndFrame(const uint16_t *palette)
+{
+    CAP_T4_FrameHeader *h = &cap.header;
+    h->magic = CAP_T4_FRAME_MAGIC;
+    h->frame = cap.presented - 1;
+    h->ms = millis() - cap.start_ms;
+    memcpy(h->palette, palette, sizeof(h->palette));
+    h->flags = (cap.stats.captured % CAP_T4_KEYFRAME_INTERVAL == 0) ? CAP_T4_KEYFRAME : 0;
+    cap.stats.keyframes += h->flags & CAP_T4_KEYFRAME;
+    cap.stats.captured++;
+    cap.stats.pack_cycles += ARM_DWT_CYCCNT - cap.pack_start;
+
+    cap.frame_ready = true;
+    cap.band = 0;
+    cap.crc = 0xFFFFFFFF;
+    cap.enc_len = sizeof(CAP_T4_FrameHeader);
+}
+
+static int CAP_T4_Literals(const uint8_t *in, int len, uint8_t *out)
+{
+    int n = 0;
+    while (len > 0)
+    {
+        int chunk = CK_Cross_min(len, 128);
+        out[n++] = chunk - 1;
+        memcpy(&out[n], in, chunk);
+        n += chunk;
+        in += chunk;
+        len -= chunk;
+    }
+    return n;
+}
+
+//Run length encode one band. Returns the encoded size. The format is described with CAP_T4_FrameHeader.
+static int CAP_T4_Rle(const uint8_t *in, int len, uint8_t *out)
+{
+    int n = 0;
+    int literal_start = 0;
+    int i = 0;
+    while (i < len)
+    {
+        int run = 1;
+        while (i + run < len && in[i + run] == in[i] && run < 0xFFFF)
+        {
+            run++;
+        }
+        if (run < 3)
+        {
+            i += run;
+            continue;
+        }
+        n += CAP_T4_Literals(&in[literal_start], i - literal_start, &out[n]);
+        if (in[i] == 0 && run > 129)
+        {
+            out[n++] = 0xFF;
+            out[n++] = run & 0xFF;
+            out[n++] = run >> 8;
+        }
+        else
+        {
+            run = CK_Cross_min(run, 129);
+            out[n++] = 0x7D + run;
+            out[n++] = in[i];
+        }
+        i += run;
+        literal_start = i;
+    }
+    n += CAP_T4_Literals(&in[literal_start], len - literal_start, &out[n]);
+    return n;
+}
+
+static void CAP_T4_EncodeBand()
+{
+    CAP_T4_Buffers *b = cap.buf;
+    bool keyframe = cap.header.flags & CAP_T4_KEYFRAME;
+    int offset = cap.band * BAND_BYTES;
+    const uint8_t *frame = &b->frame[offset];
+    uint8_t *last = &b->last[offset];
+    uint32_t crc = cap.crc;
+    for (int i = 0; i < BAND_BYTES; i++)
+    {
+        uint8_t v = frame[i];
+        crc = b->crc_table[(crc ^ v) & 0xFF] ^ (crc >> 8);
+        b->delta[i] = keyframe ? v : (v ^ last[i]);
+        last[i] = v;
+    }
+    cap.crc = crc;
+    cap.enc_len += CAP_T4_Rle(b->delta, BAND_BYTES, &b->out[cap.enc_len]);
+
+    if (++cap.band == BANDS)
+    {
+        cap.header.crc = ~cap.crc;
+        cap.header.size = cap.enc_len - sizeof(CAP_T4_FrameHeader);
+        memcpy(b->out, &cap.header, sizeof(CAP_T4_FrameHeader));
+        cap.out_len = cap.enc_len;
+        cap.out_pos = 0;
+        cap.frame_ready = false;
+    }
+}
+
+//Follow a slower step at once, and come back down slowly after faster ones
+static void CAP_T4_Measured(uint32_t *estimate, uint32_t us)
+{
+    *estimate = (us > *estimate) ? us : *estimate - (*estimate - us) / 8;
+}
+
+//Whether a step estimated to take estimate us fits in time_left. If not the estimate decays a little, so a single
+//slow step doesn't hold the capture back for good.
+static bool CAP_T4_Fits(uint32_t *estimate, int32_t time_left)
+{
+    if (time_left >= (int32_t)*estimate)
+    {
+        return true;
+    }
+    *estimate -= *estimate / 8;
+    return false;
+}
+
+//Returns false if nothing could be written
+static bool CAP_T4_Drain(int32_t time_left)
+{
+    int n = cap.out_len - cap.out_pos;
+    if (cap.target == CAP_T4_USB)
+    {
+        n = CK_Cross_min(n, Serial.availableForWrite());
+        if (n <= 0)
+        {
+            return false;
+        }
+        Serial.write(&cap.buf->out[cap.out_pos], n);
+    }
+    else
+    {
+        if (!CAP_T4_Fits(&cap.write_us, time_left))
+        {
+            return false;
+        }
+        n = CK_Cross_min(n, SD_CHUNK);
+        uint32_t start = micros();
+        cap.file.write(&cap.buf->out[cap.out_pos], n);
+        uint32_t us = micros() - start;
+        CAP_T4_Measured(&cap.write_us, us);
+        cap.stats.write_us_max = CK_Cross_max(cap.stats.write_us_max, us);
+    }
+    cap.out_pos += n;
+    cap.stats.bytes += n;
+    return true;
+}
+
+FLASHMEM static void CAP_T4_PrintStats()
+{
+    uint32_t frames = CK_Cross_max(1, cap.stats.captured);
+    printf("CAP: %lu frames captured, %lu skipped, %lu keyframes. %lu bytes, %lu per frame\n", cap.stats.captured,
+           cap.stats.skipped, cap.stats.keyframes, cap.stats.bytes, cap.stats.bytes / frames);
+    printf("CAP: %lu cycles/frame copying in present, %lu cycles/frame encoding. Slowest SD write %lu us\n",
+           cap.stats.pack_cycles / frames, cap.stats.encode_cycles / frames, cap.stats.write_us_max);
+    printf("CAP: Estimates %lu us per band, %lu us per SD write\n", cap.band_us, cap.write_us);
+}
+
+FLASHMEM static void CAP_T4_Free()
+{
+    MEM_T4_TrackFree(cap.buf);
+    if (cap.buf_in_extmem)
+    {
+        extmem_free(cap.buf);
+    }
+    else
+    {
+        free(cap.buf);
+    }
+    cap.buf = NULL;
+}
+
+FLASHMEM static void CAP_T4_Finish()
+{
+    if (cap.target == CAP_T4_SD)
+    {
+        cap.file.close();
+    }
+    CAP_T4_Free();
+    printf("CAP: Capture finished\n");
+    CAP_T4_PrintStats();
+}
+
+void CAP_T4_Poll(int32_t budget_us)
+{
+    if (cap.buf == NULL)
+    {
+        return;
+    }
+
+    uint32_t start = micros();
+    while (1)
+    {
+        int32_t time_left = budget_us - (int32_t)(micros() - start);
+        if (cap.out_pos < cap.out_len)
+        {
+            if (!CAP_T4_Drain(time_left))
+            {
+                return;
+            }
+        }
+        else if (cap.frame_ready)
+        {
+            if (!CAP_T4_Fits(&cap.band_us, time_left))
+            {
+                return;
+            }
+            uint32_t cycles = ARM_DWT_CYCCNT;
+            CAP_T4_EncodeBand();
+            cycles = ARM_DWT_CYCCNT - cycles;
+            cap.stats.encode_cycles += cycles;
+            CAP_T4_Measured(&cap.band_us, cycles / (F_CPU_ACTUAL / 1000000));
+        }
+        else
+        {
+            if (!cap.active)
+            {
+                CAP_T4_Finish();
+            }
+            return;
+        }
+    }
+}
+
+FLASHMEM static void CAP_T4_Start(CAP_T4_Target target)
+{
+    cap.buf_in_extmem = false;
+    cap.buf = (CAP_T4_Buffers *)malloc(sizeof(CAP_T4_Buffers));
+    if (cap.buf == NULL)
+    {
+        cap.buf_in_extmem = true;
+        cap.buf = (CAP_T4_Buffers *)extmem_malloc(sizeof(CAP_T4_Buffers));
+    }
+    if (cap.buf == NULL)
+    {
+        printf("CAP: Could not allocate %u bytes\n", sizeof(CAP_T4_Buffers));
+        return;
+    }
+    MEM_T4_TrackAlloc(cap.buf, sizeof(CAP_T4_Buffers), MEM_T4_TAG_CAPTURE);
+
+    cap.target = target;
+    if (target == CAP_T4_SD)
+    {
+        cap.file = SD.open(CAP_T4_FILE, FILE_WRITE_BEGIN);
+        if (!cap.file)
+        {
+            printf("CAP: Could not create %s\n", CAP_T4_FILE);
+            CAP_T4_Free();
+            return;
+        }
+        cap.file.truncate();
+    }
+
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        }
+        cap.buf->crc_table[i] = c;
+    }
+
+    CAP_T4_StreamHeader *h = (CAP_T4_StreamHeader *)cap.buf->out;
+    memset(h, 0, sizeof(*h));
+    h->magic = CAP_T4_MAGIC;
+    h->version = CAP_T4_VERSION;
+    h->width = CAP_T4_WIDTH;
+    h->height = CAP_T4_HEIGHT;
+    h->keyframe_interval = CAP_T4_KEYFRAME_INTERVAL;
+    cap.out_len = sizeof(*h);
+    cap.out_pos = 0;
+    cap.frame_ready = false;
+    cap.presented = 0;
+    cap.start_ms = millis();
+    memset(&cap.stats, 0, sizeof(cap.stats));
+    cap.band_us = BAND_ESTIMATE_US;
+    cap.write_us = SD_WRITE_ESTIMATE_US;
+    cap.active = true;
+    printf("CAP: Capturing to %s\n", (target == CAP_T4_SD) ? CAP_T4_FILE : "USB serial");
+}
+
+FLASHMEM static void CAP_T4_Toggle(CAP_T4_Target target)
+{
+    if (cap.active)
+    {
+        cap.active = false;
+        printf("CAP: Stopping\n");
+    }
+    else if (cap.buf != NULL)
+    {
+        //Such as USB serial not being read
+        printf("CAP: Abandoning the rest of the last capture\n");
+        CAP_T4_Finish();
+    }
+    else
+    {
+        CAP_T4_Start(target);
+    }
+}
+
+FLASHMEM static void CAP_T4_ToggleSD()
+{
+    CAP_T4_Toggle(CAP_T4_SD);
+}
+
+FLASHMEM static void CAP_T4_ToggleUSB()
+{
+    CAP_T4_Toggle(CAP_T4_USB);
+}
+
+FLASHMEM void CAP_T4_Startup()
+{
+    CON_T4_Register('k', "Start or stop capturing frames to " CAP_T4_FILE, CAP_T4_ToggleSD);
+    CON_T4_Register('K', "Start or stop capturing frames to USB serial", CAP_T4_ToggleUSB);
+}
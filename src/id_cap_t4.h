@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_CAP_T4_H
+#define ID_CAP_T4_H
+
+#include <stdint.h>
+
+//Capture of presented frames, for reproducing rendering bugs and checking that a change doesn't alter
+//the output. Send 'k' on the console to start or stop capturing to T4CAP.BIN on the SD card, or 'K'
+//for USB serial. Decode with tools/t4cap.py.
+//
+//Present only copies the 320x200 window as 4 bit palette indexes. In idle frame time each frame is
+//XORed with the last captured one, run length encoded and checksummed, then written out. A frame
+//presented while the previous one is still being encoded or written is skipped, so capturing never
+//holds up the game.
+
+#ifndef CAP_T4_KEYFRAME_INTERVAL
+#define CAP_T4_KEYFRAME_INTERVAL 64 //Captured frames between frames that don't depend on the last one
+#endif
+
+#define CAP_T4_FILE "T4CAP.BIN"
+#define CAP_T4_MAGIC 0x50433454       //"T4CP"
+#define CAP_T4_FRAME_MAGIC 0x52463454 //"T4FR"
+#define CAP_T4_VERSION 1
+#define CAP_T4_WIDTH 320
+#define CAP_T4_HEIGHT 200
+#define CAP_T4_FRAME_BYTES (CAP_T4_WIDTH * CAP_T4_HEIGHT / 2) //Two pixels a byte, left in the low nibble
+
+//Sent once at the start of a capture
+typedef struct CAP_T4_StreamHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t width, height;
+    uint16_t keyframe_interval;
+    uint32_t reserved;
+} CAP_T4_StreamHeader;
+
+#define CAP_T4_KEYFRAME 0x01 //Encoded against a blank frame instead of the last one
+
+//Before the encoded data of each frame. The data is the frame XORed with the previous one, in bands of
+//CAP_T4_BAND_ROWS rows. Each band is a run of:
+//  0x00-0x7F: copy the next n + 1 bytes
+//  0x80-0xFE: repeat the next byte n - 0x7D times
+//  0xFF: the next two bytes are a little endian count of zero bytes
+typedef struct CAP_T4_FrameHeader
+{
+    uint32_t magic;
+    uint32_t frame; //Frames presented since the capture started, so skipped ones show as gaps
+    uint32_t ms;
+    uint32_t crc;   //CRC-32 of the decoded frame
+    uint32_t size;  //Bytes of encoded data that follow
+    uint16_t palette[16]; //RGB565
+    uint8_t flags;
+    uint8_t reserved[3];
+} CAP_T4_FrameHeader;
+
+#define CAP_T4_BAND_ROWS 20
+
+void CAP_T4_Startup();
+bool CAP_T4_Active();
+//Returns the buffer for the presented frame, or NULL if this frame is to be skipped. If a buffer is
+//returned it must be filled and passed to CAP_T4_EndFrame.
+uint8_t *CAP_T4_BeginFrame();
+void CAP_T4_EndFrame(const uint16_t *palette);
+//Called while idle. Encodes and writes out captured frames for up to budget_us.
+void CAP_T4_Poll(int32_t budget_us);
+
+#endif
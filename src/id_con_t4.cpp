@@ -0,0 +1,76 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <Arduino.h>
+#include "id_con_t4.h"
+#include "id_log_t4.h"
+
+extern "C"
+{
+#include "printf.h"
+}
+
+static const int MAX_COMMANDS = 16;
+
+typedef struct CON_T4_Command
+{
+    char cmd;
+    const char *help;
+    CON_T4_Handler handler;
+} CON_T4_Command;
+
+static CON_T4_Command commands[MAX_COMMANDS];
+static int num_commands = 0;
+
+FLASHMEM void CON_T4_Register(char cmd, const char *help, CON_T4_Handler handler)
+{
+    for (int i = 0; i < num_commands; i++)
+    {
+        if (commands[i].cmd == cmd)
+        {
+            commands[i].help = help;
+            commands[i].handler = handler;
+            return;
+        }
+    }
+
+    if (num_commands >= MAX_COMMANDS)
+    {
+        LOG_T4_WARN("%s: No room for command '%c'\n", __FUNCTION__, cmd);
+        return;
+    }
+    commands[num_commands].cmd = cmd;
+    commands[num_commands].help = help;
+    commands[num_commands].handler = handler;
+    num_commands++;
+}
+
+FLASHMEM static void CON_T4_PrintHelp()
+{
+    printf("Commands:\n");
+    for (int i = 0; i < num_commands; i++)
+    {
+        printf(" %c - %s\n", commands[i].cmd, commands[i].help);
+    }
+}
+
+void CON_T4_Poll()
+{
+    while (Serial1.available())
+    {
+        char c = Serial1.read();
+        if (c == '\r' || c == '\n' || c == ' ')
+        {
+            continue;
+        }
+
+        CON_T4_Handler handler = CON_T4_PrintHelp;
+        for (int i = 0; i < num_commands; i++)
+        {
+            if (commands[i].cmd == c)
+            {
+                handler = commands[i].handler;
+                break;
+            }
+        }
+        handler();
+    }
+}
@@ -0,0 +1,13 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_CON_T4_H
+#define ID_CON_T4_H
+
+//Single character debug commands received over Serial1. Send '?' for a list.
+
+typedef void (*CON_T4_Handler)(void);
+
+void CON_T4_Register(char cmd, const char *help, CON_T4_Handler handler);
+//Called while idle to handle any pending commands.
+void CON_T4_Poll();
+
+#endif
@@ -1,22 +1,43 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <Arduino.h>
 #include <SD.h>
+#include "id_mem_t4.h"
+#include "id_con_t4.h"
+#include "id_fs_t4.h"
+#include "id_fs_t4_pack.h"
+#include "id_log_t4.h"
+#include "id_rec_t4.h"
+#include "id_vl_t4.h"
 
 extern "C"
 {
 #include "printf.h"
 #include "id_fs.h"
+#include "id_ca.h"
 #include "ck_cross.h"
 #include "ck_ep.h"
+#include "ck_def.h"
+#include "ck_play.h"
 }
 static const int MAX_FILES = 12;
 File fp[MAX_FILES + 1];
 
+//User files are held whole in PSRAM rather than open on the SD card, as described with FS_T4_UserHeader
+typedef struct FS_T4_UserFile
+{
+    uint8_t *data; //Set while the handle is a user file
+    uint32_t size, capacity, pos;
+    bool writing;
+    char name[16];
+} FS_T4_UserFile;
+
+static FS_T4_UserFile user[MAX_FILES + 1];
+
 FLASHMEM static int get_handle()
 {
     for (int handle = 1; handle <= MAX_FILES; handle++)
     {
-        if (!fp[handle])
+        if (!fp[handle] && user[handle].data == NULL)
             return handle;
     }
     return 0;
@@ -36,43 +57,695 @@ FLASHMEM static File *get_file(int handle)
     return &fp[handle];
 }
 
+//Asynchronous reads. Requests are serviced in order, in idle time through FS_T4_Poll or when a caller waits on
+//one. After the first step brings the file position to a sector boundary, each step is a large whole sector
+//read that the SD library transfers straight into the destination as one multi-block command.
+#define FS_T4_READ_STEP (16 * 1024) //A multiple of the sector size
+#define FS_T4_SECTOR 512
+
+typedef struct FS_T4_Read
+{
+    FS_File handle;
+    uint32_t offset;
+    uint8_t *dst;
+    uint32_t size;
+    uint32_t done;
+    uint32_t submit_us;
+} FS_T4_Read;
+
+static struct
+{
+    FS_T4_Read queue[FS_T4_MAX_READS];
+    uint32_t head, tail; //Ids of the next request to submit and the next to service
+    uint32_t submitted, bytes, steps, us, step_us_max;
+    uint32_t depth_max, waits, wait_us;
+    uint32_t idle_step_us; //Recent worst idle step, decaying. Decides whether another step fits the idle budget.
+} reads;
+
+//Run one step of the oldest request. Returns false if the queue is empty.
+static bool FS_T4_ReadStep()
+{
+    if (reads.tail == reads.head)
+    {
+        return false;
+    }
+    uint32_t start = micros();
+    FS_T4_Read *r = &reads.queue[reads.tail % FS_T4_MAX_READS];
+    File *f = get_file(r->handle);
+    uint32_t pos = r->offset + r->done;
+    uint32_t n = r->size - r->done;
+    if (pos % FS_T4_SECTOR)
+    {
+        n = CK_Cross_min(n, FS_T4_SECTOR - pos % FS_T4_SECTOR);
+    }
+    else
+    {
+        n = CK_Cross_min(n, (uint32_t)FS_T4_READ_STEP);
+    }
+
+    int br = -1;
+    if (n == 0)
+    {
+        br = 0; //Cancelled, so the file may already be closed
+    }
+    else if (f != NULL && (f->position() == pos || f->seek(pos)))
+    {
+        br = f->read(r->dst + r->done, n);
+    }
+    if (br > 0)
+    {
+        r->done += br;
+        reads.bytes += br;
+    }
+    //A short read ends the request early
+    if (br != (int)n || r->done == r->size)
+    {
+        REC_T4_Record(REC_T4_FS_READ, r->handle, r->done, micros() - r->submit_us);
+        reads.tail++;
+    }
+
+    uint32_t us = micros() - start;
+    reads.steps++;
+    reads.us += us;
+    reads.step_us_max = CK_Cross_max(reads.step_us_max, us);
+    return true;
+}
+
+//Service queued reads for up to budget_us, only starting a step if the recent slowest idle step would still fit.
+//Steps run while the game waits on a read don't count, and the estimate decays each time it holds a step back,
+//so one stall can't keep idle reads off for the rest of the session.
+static void FS_T4_ReadService(uint32_t budget_us)
+{
+    uint32_t start = micros();
+    while (reads.tail != reads.head)
+    {
+        if (micros() - start + reads.idle_step_us >= budget_us)
+        {
+            reads.idle_step_us -= reads.idle_step_us / 8;
+            break;
+        }
+        uint32_t step_start = micros();
+        FS_T4_ReadStep();
+        uint32_t us = micros() - step_start;
+        reads.idle_step_us = (us > reads.idle_step_us) ? us : reads.idle_step_us - (reads.idle_step_us - us) / 8;
+    }
+}
+
+uint32_t FS_T4_ReadSubmit(int handle, uint32_t offset, void *dst, uint32_t size)
+{
+    //Make room by finishing the oldest request
+    while (reads.head - reads.tail == FS_T4_MAX_READS)
+    {
+        FS_T4_ReadStep();
+    }
+    FS_T4_Read *r = &reads.queue[reads.head % FS_T4_MAX_READS];
+    r->handle = handle;
+    r->offset = offset;
+    r->dst = (uint8_t *)dst;
+    r->size = size;
+    r->done = 0;
+    r->submit_us = micros();
+    reads.submitted++;
+    reads.depth_max = CK_Cross_max(reads.depth_max, reads.head + 1 - reads.tail);
+    return reads.head++;
+}
+
+bool FS_T4_ReadPoll(uint32_t id, uint32_t *bytes)
+{
+    if ((int32_t)(id - reads.tail) >= 0)
+    {
+        return false;
+    }
+    if (bytes)
+    {
+        *bytes = reads.queue[id % FS_T4_MAX_READS].done;
+    }
+    return true;
+}
+
+uint32_t FS_T4_ReadWait(uint32_t id)
+{
+    uint32_t bytes;
+    if (!FS_T4_ReadPoll(id, &bytes))
+    {
+        //The game is about to block on the SD card, so get the last frame it presented onto the display first
+        VL_T4_PresentFlush();
+    }
+    uint32_t start = micros();
+    while (!FS_T4_ReadPoll(id, &bytes))
+    {
+        FS_T4_ReadStep();
+    }
+    reads.waits++;
+    reads.wait_us += micros() - start;
+    return bytes;
+}
+
+void FS_T4_ReadCancel(uint32_t id)
+{
+    if (!FS_T4_ReadPoll(id, NULL))
+    {
+        //Nothing is left to read, so the next step completes it without touching the destination
+        FS_T4_Read *r = &reads.queue[id % FS_T4_MAX_READS];
+        r->size = r->done;
+    }
+}
+
+FLASHMEM static void FS_T4_ReadPrintStats()
+{
+    printf("FS: Reads %lu submitted, %lu in flight, max queue depth %lu\n", reads.submitted, reads.head - reads.tail,
+           reads.depth_max);
+    printf("FS: %lu bytes in %lu steps, %lu us (%lu KB/s), slowest step %lu us. %lu waits, %lu us waiting\n",
+           reads.bytes, reads.steps, reads.us, reads.us ? (uint32_t)((uint64_t)reads.bytes * 1000000 / 1024 / reads.us) : 0,
+           reads.step_us_max, reads.waits, reads.wait_us);
+    printf("FS: Idle step estimate %lu us\n", reads.idle_step_us);
+}
+
+//User files, such as saved games and the config, are held whole in PSRAM so saving and loading don't stall the
+//game on lots of small SD transfers. A created file is written into a PSRAM buffer. Closing it queues a commit
+//that in idle time LZ4 compresses saved games a block at a time and writes the file to a temporary file, then
+//renames that into place, moving the old file aside to a .BAK until it is, so a save that is cut short leaves the
+//previous one intact and FS_T4_UserRecover puts it back. The config and
+//anything else stay plain, so they can still be read and edited elsewhere. Opening a user file reads all of
+//it in one transfer, or copies it from a commit that hasn't reached the SD card yet, and reads are served from
+//memory. Files without a FS_T4_UserHeader, such as saves from DOS, are read as they are.
+#ifndef FS_T4_COMPRESS_USER
+#define FS_T4_COMPRESS_USER 1 //0 writes saved games as plain copies, readable by other ports
+#endif
+#define FS_T4_USER_MAGIC 0x46553454 //"T4UF"
+#define FS_T4_USER_BLOCK (4 * 1024)  //Bytes of a saved game compressed in one step
+#define FS_T4_USER_STORED 0x80000000u //Set in a block's length if it is stored as is
+#define FS_T4_MAX_COMMITS 4
+#define FS_T4_WRITE_STEP (4 * 1024)
+#define FS_T4_COMMIT_MAX_WAIT_MS 1000 //A commit waiting this long gets a step even without idle time
+
+static FS_File open_file(const char *filename, int mode);
+static uint32_t FS_T4_LZ4Compress(const uint8_t *src, uint32_t len, uint8_t *dst);
+static uint32_t FS_T4_LZ4Decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t dst_len);
+
+//Followed by the file in blocks of up to block bytes, each compressed on its own as a 32-bit length and that many
+//bytes of LZ4 block data, or of the block as is if FS_T4_USER_STORED is set in the length
+typedef struct FS_T4_UserHeader
+{
+    uint32_t magic;
+    uint32_t size;   //Bytes once decompressed
+    uint32_t packed; //Bytes of blocks that follow
+    uint32_t block;
+} FS_T4_UserHeader;
+
+typedef struct FS_T4_Commit
+{
+    char name[16];
+    uint8_t *data; //The file as written
+    uint32_t size;
+    uint8_t *out;  //What goes to the SD card. NULL until started, and data itself if it isn't compressed.
+    uint32_t out_size, written;
+    uint32_t compressed; //Bytes of data compressed into out so far
+    File file;
+    uint32_t queued_ms, us;
+} FS_T4_Commit;
+
+static struct
+{
+    FS_T4_Commit queue[FS_T4_MAX_COMMITS];
+    uint32_t head, tail;
+    uint32_t commits, failures, bytes, bytes_written, us, step_us_max, latency_ms_max;
+    uint32_t opens, pending_opens, open_us_max;
+    uint32_t idle_step_us; //Recent worst step, decaying, as for reads
+    bool shutdown;         //Idle time won't come again, so commits are finished as they are queued
+} commits;
+
+static FS_T4_UserFile *get_user_file(int handle)
+{
+    if (handle <= 0 || handle > MAX_FILES || user[handle].data == NULL)
+        return NULL;
+
+    return &user[handle];
+}
+
+static void FS_T4_UserFree(uint8_t *data)
+{
+    MEM_T4_TrackFree(data);
+    extmem_free(data);
+}
+
+static uint8_t *FS_T4_UserAlloc(uint32_t size)
+{
+    uint8_t *data = (uint8_t *)extmem_malloc(CK_Cross_max(size, 1));
+    if (data)
+    {
+        MEM_T4_TrackAlloc(data, CK_Cross_max(size, 1), MEM_T4_TAG_USERFILE);
+    }
+    return data;
+}
+
+//The newest commit of filename that hasn't finished, or NULL
+static FS_T4_Commit *FS_T4_CommitFind(const char *filename)
+{
+    for (uint32_t id = commits.head; id != commits.tail; id--)
+    {
+        FS_T4_Commit *c = &commits.queue[(id - 1) % FS_T4_MAX_COMMITS];
+        if (strcasecmp(c->name, filename) == 0)
+        {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+//Saved games are SAVEGAMn.CKx
+static bool FS_T4_UserCompressed(const char *filename)
+{
+    return FS_T4_COMPRESS_USER && strncasecmp(filename, "SAVEGAM", 7) == 0;
+}
+
+//filename with ext added, keeping its own extension so CONFIG.CK4 and CONFIG.CK5 don't share one
+FLASHMEM static void FS_T4_UserSideName(const char *filename, const char *ext, char *name)
+{
+    strcpy(name, filename);
+    strcat(name, ext);
+}
+
+//A save cut short after moving the old file aside, but before renaming the new one into place, leaves only the
+//.BAK. Put it back.
+FLASHMEM static void FS_T4_UserRecover(const char *filename)
+{
+    char bak[20];
+    FS_T4_UserSideName(filename, ".BAK", bak);
+    if (!SD.exists(filename) && SD.exists(bak))
+    {
+        LOG_T4_WARN("%s: Recovering %s from %s\n", __FUNCTION__, filename, bak);
+        SD.rename(bak, filename);
+    }
+}
+
+FLASHMEM static void FS_T4_CommitEnd(FS_T4_Commit *c, bool ok)
+{
+    if (c->out && c->out != c->data)
+    {
+        FS_T4_UserFree(c->out);
+    }
+    FS_T4_UserFree(c->data);
+    c->data = c->out = NULL;
+    if (ok)
+    {
+        commits.commits++;
+        commits.bytes += c->size;
+        commits.bytes_written += c->out_size;
+        commits.latency_ms_max = CK_Cross_max(commits.latency_ms_max, millis() - c->queued_ms);
+    }
+    else
+    {
+        commits.failures++;
+        LOG_T4_ERROR("FS: Could not save %s\n", c->name);
+    }
+    commits.tail++;
+}
+
+//Run one step of the oldest commit. Returns false if there is nothing to commit.
+static bool FS_T4_CommitStep()
+{
+    if (commits.tail == commits.head)
+    {
+        return false;
+    }
+    uint32_t start = micros();
+    FS_T4_Commit *c = &commits.queue[commits.tail % FS_T4_MAX_COMMITS];
+    char temp[20];
+    FS_T4_UserSideName(c->name, ".TMP", temp);
+
+    if (c->out == NULL)
+    {
+        //Room for every block stored as is, and for the compressor running a few bytes past the end of the last
+        uint32_t blocks = (c->size + FS_T4_USER_BLOCK - 1) / FS_T4_USER_BLOCK;
+        bool compress = c->size && FS_T4_UserCompressed(c->name);
+        c->out = compress ? FS_T4_UserAlloc(sizeof(FS_T4_UserHeader) + c->size + blocks * 4 + 16) : NULL;
+        if (c->out)
+        {
+            c->out_size = sizeof(FS_T4_UserHeader);
+        }
+        else
+        {
+            c->out = c->data;
+            c->out_size = c->size;
+        }
+    }
+    else if (c->out != c->data && c->compressed < c->size)
+    {
+        uint32_t n = CK_Cross_min(c->size - c->compressed, (uint32_t)FS_T4_USER_BLOCK);
+        uint8_t *dst = &c->out[c->out_size + 4];
+        uint32_t packed = FS_T4_LZ4Compress(&c->data[c->compressed], n, dst);
+        if (packed == 0)
+        {
+            memcpy(dst, &c->data[c->compressed], n);
+            packed = n | FS_T4_USER_STORED;
+        }
+        memcpy(&c->out[c->out_size], &packed, 4);
+        c->out_size += 4 + (packed & ~FS_T4_USER_STORED);
+        c->compressed += n;
+        if (c->compressed == c->size)
+        {
+            if (c->out_size < sizeof(FS_T4_UserHeader) + c->size)
+            {
+                FS_T4_UserHeader h = {FS_T4_USER_MAGIC, c->size, c->out_size - (uint32_t)sizeof(h), FS_T4_USER_BLOCK};
+                memcpy(c->out, &h, sizeof(h));
+            }
+            else
+            {
+                FS_T4_UserFree(c->out);
+                c->out = c->data;
+                c->out_size = c->size;
+            }
+        }
+    }
+    else if (!c->file)
+    {
+        c->file = SD.open(temp, FILE_WRITE_BEGIN);
+        if (!c->file)
+        {
+            FS_T4_CommitEnd(c, false);
+            return true;
+        }
+        c->file.truncate();
+    }
+    else if (c->written < c->out_size)
+    {
+        uint32_t n = CK_Cross_min(c->out_size - c->written, (uint32_t)FS_T4_WRITE_STEP);
+        if (c->file.write(&c->out[c->written], n) != n)
+        {
+            c->file.close();
+            SD.remove(temp);
+            FS_T4_CommitEnd(c, false);
+            return true;
+        }
+        c->written += n;
+    }
+    else
+    {
+        //FAT has no rename over an existing file, so the old one is moved aside first. The temporary file is
+        //complete by now, and there is a whole copy under the name or the .BAK at every point.
+        c->file.close();
+        char bak[20];
+        FS_T4_UserSideName(c->name, ".BAK", bak);
+        bool ok = true;
+        if (SD.exists(c->name))
+        {
+            if (SD.exists(bak))
+            {
+                SD.remove(bak);
+            }
+            ok = SD.rename(c->name, bak);
+        }
+        ok = ok && SD.rename(temp, c->name);
+        if (ok)
+        {
+            SD.remove(bak);
+        }
+        else
+        {
+            FS_T4_UserRecover(c->name);
+        }
+        c->us += micros() - start;
+        commits.us += c->us;
+        FS_T4_CommitEnd(c, ok);
+        return true;
+    }
+
+    uint32_t us = micros() - start;
+    c->us += us;
+    commits.step_us_max = CK_Cross_max(commits.step_us_max, us);
+    return true;
+}
+
+//Run commit steps for up to budget_us, only starting one if the recent slowest step would still fit
+static void FS_T4_CommitService(uint32_t budget_us)
+{
+    uint32_t start = micros();
+    bool first = true;
+    while (commits.tail != commits.head)
+    {
+        FS_T4_Commit *c = &commits.queue[commits.tail % FS_T4_MAX_COMMITS];
+        bool overdue = first && millis() - c->queued_ms > FS_T4_COMMIT_MAX_WAIT_MS;
+        if (!overdue && micros() - start + commits.idle_step_us >= budget_us)
+        {
+            commits.idle_step_us -= commits.idle_step_us / 8;
+            return;
+        }
+        uint32_t step_start = micros();
+        FS_T4_CommitStep();
+        uint32_t us = micros() - step_start;
+        commits.idle_step_us =
+            (us > commits.idle_step_us) ? us : commits.idle_step_us - (commits.idle_step_us - us) / 8;
+        first = false;
+    }
+}
+
+//Finish every queued commit now
+FLASHMEM static void FS_T4_CommitFlush()
+{
+    while (FS_T4_CommitStep())
+    {
+    }
+}
+
+FLASHMEM static void FS_T4_CommitQueue(FS_T4_UserFile *u)
+{
+    //Make room by finishing the oldest commit
+    while (commits.head - commits.tail == FS_T4_MAX_COMMITS)
+    {
+        FS_T4_CommitStep();
+    }
+    FS_T4_Commit *c = &commits.queue[commits.head % FS_T4_MAX_COMMITS];
+    strcpy(c->name, u->name);
+    c->data = u->data;
+    c->size = u->size;
+    c->out = NULL;
+    c->out_size = c->written = c->compressed = 0;
+    c->file = File();
+    c->queued_ms = millis();
+    c->us = 0;
+    commits.head++;
+    if (commits.shutdown)
+    {
+        FS_T4_CommitFlush();
+    }
+}
+
+FLASHMEM static FS_File FS_T4_UserHandle(const char *filename, uint8_t *data, uint32_t size, uint32_t capacity,
+                                         bool writing)
+{
+    int handle = get_handle();
+    if (handle == 0 || strlen(filename) >= sizeof(user[0].name))
+    {
+        LOG_T4_WARN("%s: Could not find handle for file %s\n", __FUNCTION__, filename);
+        FS_T4_UserFree(data);
+        return 0;
+    }
+    FS_T4_UserFile *u = &user[handle];
+    u->data = data;
+    u->size = size;
+    u->capacity = capacity;
+    u->pos = 0;
+    u->writing = writing;
+    strcpy(u->name, filename);
+    return handle;
+}
+
+//Undo the block compression of a saved game into dst, which has room for h->size bytes. Returns false if it is
+//damaged.
+FLASHMEM static bool FS_T4_UserExpand(const FS_T4_UserHeader *h, const uint8_t *src, uint8_t *dst)
+{
+    uint32_t in = 0, out = 0;
+    while (out < h->size)
+    {
+        uint32_t packed;
+        if (h->packed - in < 4)
+        {
+            return false;
+        }
+        memcpy(&packed, &src[in], 4);
+        in += 4;
+        uint32_t n = CK_Cross_min(h->size - out, h->block);
+        uint32_t len = packed & ~FS_T4_USER_STORED;
+        if (len > h->packed - in)
+        {
+            return false;
+        }
+        if (packed & FS_T4_USER_STORED)
+        {
+            if (len != n)
+            {
+                return false;
+            }
+            memcpy(&dst[out], &src[in], n);
+        }
+        else if (FS_T4_LZ4Decompress(&src[in], len, &dst[out], n) != n)
+        {
+            return false;
+        }
+        in += len;
+        out += n;
+    }
+    return in == h->packed;
+}
+
+FLASHMEM static FS_File FS_T4_UserOpen(const char *filename)
+{
+    uint32_t start = micros();
+    uint8_t *data;
+    uint32_t size;
+    FS_T4_Commit *c = FS_T4_CommitFind(filename);
+    if (c)
+    {
+        size = c->size;
+        data = FS_T4_UserAlloc(size);
+        if (data == NULL)
+        {
+            return 0;
+        }
+        memcpy(data, c->data, size);
+        commits.pending_opens++;
+    }
+    else
+    {
+        FS_T4_UserRecover(filename);
+        FS_File sd = open_file(filename, FILE_READ);
+        if (sd == 0)
+        {
+            return 0;
+        }
+        size = FS_GetFileSize(sd);
+        data = FS_T4_UserAlloc(size);
+        uint32_t bytes = data ? FS_T4_ReadWait(FS_T4_ReadSubmit(sd, 0, data, size)) : 0;
+        FS_CloseFile(sd);
+        if (data == NULL || bytes != size)
+        {
+            LOG_T4_WARN("%s: Could not load %s\n", __FUNCTION__, filename);
+            if (data)
+            {
+                FS_T4_UserFree(data);
+            }
+            return 0;
+        }
+
+        FS_T4_UserHeader h;
+        if (size >= sizeof(h))
+        {
+            memcpy(&h, data, sizeof(h));
+        }
+        if (size >= sizeof(h) && h.magic == FS_T4_USER_MAGIC)
+        {
+            uint8_t *expanded = (h.packed == size - sizeof(h) && h.block) ? FS_T4_UserAlloc(h.size) : NULL;
+            if (expanded == NULL || !FS_T4_UserExpand(&h, data + sizeof(h), expanded))
+            {
+                LOG_T4_WARN("%s: %s is damaged\n", __FUNCTION__, filename);
+                if (expanded)
+                {
+                    FS_T4_UserFree(expanded);
+                }
+                FS_T4_UserFree(data);
+                return 0;
+            }
+            FS_T4_UserFree(data);
+            data = expanded;
+            size = h.size;
+        }
+    }
+    commits.opens++;
+    commits.open_us_max = CK_Cross_max(commits.open_us_max, micros() - start);
+    return FS_T4_UserHandle(filename, data, size, size, false);
+}
+
+FLASHMEM static void FS_T4_UserPrintStats()
+{
+    printf("FS: User files %lu opened, %lu of them from memory before reaching the SD card, slowest %lu us\n",
+           commits.opens, commits.pending_opens, commits.open_us_max);
+    printf("FS: %lu saves, %lu failed, %lu queued. %lu bytes written as %lu, %lu us, slowest step %lu us\n",
+           commits.commits, commits.failures, commits.head - commits.tail, commits.bytes, commits.bytes_written,
+           commits.us, commits.step_us_max);
+    printf("FS: Save step estimate %lu us\n", commits.idle_step_us);
+    printf("FS: Longest from closing a save to it being on the SD card %lu ms\n", commits.latency_ms_max);
+}
+
+static void FS_T4_PackPrintStats();
+
 FLASHMEM void FS_Startup()
 {
     if (!SD.begin(BUILTIN_SDCARD))
     {
-        printf("FS: SD init failed\n");
+        LOG_T4_ERROR("FS: SD init failed\n");
     }
+    CON_T4_Register('f', "File read stats", FS_T4_ReadPrintStats);
+    CON_T4_Register('p', "Asset pack load stats", FS_T4_PackPrintStats);
+    CON_T4_Register('u', "User file save and load stats", FS_T4_UserPrintStats);
 }
 
 bool FS_IsFileValid(FS_File handle)
 {
-    return (get_file(handle) != NULL);
+    return (get_file(handle) != NULL || get_user_file(handle) != NULL);
 }
 
 FLASHMEM size_t FS_Read(void *ptr, size_t size, size_t nmemb, FS_File handle)
 {
+    FS_T4_UserFile *u = get_user_file(handle);
+    if (u != NULL)
+    {
+        uint32_t n = CK_Cross_min((uint32_t)(nmemb * size), u->size - u->pos);
+        memcpy(ptr, &u->data[u->pos], n);
+        u->pos += n;
+        if (n != nmemb * size)
+        {
+            LOG_T4_WARN("%s: Read byte mismatch %d vs %d on handle %d\n", __FUNCTION__, n, nmemb * size, handle);
+        }
+        return n / size;
+    }
+
     File *fp = get_file(handle);
     if (fp == NULL)
     {
-        printf("%s: Could not find file with handle %d\n", __FUNCTION__, handle);
+        LOG_T4_ERROR("%s: Could not find file with handle %d\n", __FUNCTION__, handle);
         return 0;
     }
 
     int num_bytes = nmemb * size;
-    int br = fp->read((char *)ptr, num_bytes);
+    int br = FS_T4_ReadWait(FS_T4_ReadSubmit(handle, fp->position(), ptr, num_bytes));
     if (br != num_bytes)
     {
-        printf("%s: Read byte mismatch %d vs %d on handle %d\n", __FUNCTION__, br, num_bytes, handle);
+        LOG_T4_WARN("%s: Read byte mismatch %d vs %d on handle %d\n", __FUNCTION__, br, num_bytes, handle);
     }
     return br / size;
 }
 
 FLASHMEM size_t FS_Write(const void *ptr, size_t size, size_t nmemb, FS_File handle)
 {
+    FS_T4_UserFile *u = get_user_file(handle);
+    if (u != NULL)
+    {
+        uint32_t n = nmemb * size;
+        if (u->pos + n > u->capacity)
+        {
+            uint32_t capacity = CK_Cross_max(u->capacity * 2, u->pos + n);
+            uint8_t *data = (uint8_t *)extmem_realloc(u->data, capacity);
+            if (data == NULL)
+            {
+                LOG_T4_ERROR("%s: Could not grow handle %d to %lu bytes\n", __FUNCTION__, handle, capacity);
+                return 0;
+            }
+            MEM_T4_TrackFree(u->data);
+            MEM_T4_TrackAlloc(data, capacity, MEM_T4_TAG_USERFILE);
+            u->data = data;
+            u->capacity = capacity;
+        }
+        memcpy(&u->data[u->pos], ptr, n);
+        u->pos += n;
+        u->size = CK_Cross_max(u->size, u->pos);
+        return nmemb;
+    }
+
     File *fp = get_file(handle);
     if (fp == NULL)
     {
-        printf("%s: Could not find file with handle %d\n", __FUNCTION__, handle);
+        LOG_T4_ERROR("%s: Could not find file with handle %d\n", __FUNCTION__, handle);
         return 0;
     }
 
@@ -80,42 +753,83 @@ FLASHMEM size_t FS_Write(const void *ptr, size_t size, size_t nmemb, FS_File han
     int bw = fp->write((char *)ptr, num_bytes);
     if (bw != num_bytes)
     {
-        printf("Write byte mismatch %d %d\n", bw, num_bytes);
+        LOG_T4_WARN("%s: Write byte mismatch %d vs %d on handle %d\n", __FUNCTION__, bw, num_bytes, handle);
     }
     return bw / size;
 }
 
 FLASHMEM size_t FS_SeekTo(FS_File handle, size_t offset)
 {
+    FS_T4_UserFile *u = get_user_file(handle);
+    if (u != NULL)
+    {
+        if (offset > u->size)
+        {
+            LOG_T4_WARN("Could not seek file with handle %d to offset %d\n", handle, offset);
+        }
+        u->pos = CK_Cross_min((uint32_t)offset, u->size);
+        return offset;
+    }
+
     File *fp = get_file(handle);
     if (fp == NULL)
     {
-        printf("%s: Could not find file with handle %d\n", __FUNCTION__, handle);
+        LOG_T4_ERROR("%s: Could not find file with handle %d\n", __FUNCTION__, handle);
         return 0;
     }
 
     if (!fp->seek(offset, SeekSet))
     {
-        printf("Could not seek file with handle %d to offset %d\n", handle, offset);
+        LOG_T4_WARN("Could not seek file with handle %d to offset %d\n", handle, offset);
     }
     return offset;
 }
 
 FLASHMEM void FS_CloseFile(FS_File handle)
 {
+    FS_T4_UserFile *u = get_user_file(handle);
+    if (u != NULL)
+    {
+        if (u->writing)
+        {
+            FS_T4_CommitQueue(u);
+        }
+        else
+        {
+            FS_T4_UserFree(u->data);
+        }
+        u->data = NULL;
+        return;
+    }
+
     File *fp = get_file(handle);
     if (fp != NULL)
     {
+        //Queued reads may still refer to the handle. They are given up rather than waited for, which would mean
+        //waiting for every read ahead of them too, such as idle prefetching from the pack.
+        for (uint32_t id = reads.tail; id != reads.head; id++)
+        {
+            if (reads.queue[id % FS_T4_MAX_READS].handle == handle)
+            {
+                FS_T4_ReadCancel(id);
+            }
+        }
         fp->close();
     }
 }
 
 FLASHMEM size_t FS_GetFileSize(FS_File handle)
 {
+    FS_T4_UserFile *u = get_user_file(handle);
+    if (u != NULL)
+    {
+        return u->size;
+    }
+
     File *fp = get_file(handle);
     if (fp == NULL)
     {
-        printf("%s: Could not find file with handle %d\n", __FUNCTION__, handle);
+        LOG_T4_ERROR("%s: Could not find file with handle %d\n", __FUNCTION__, handle);
         return 0;
     }
     return fp->size();
@@ -126,15 +840,19 @@ FLASHMEM static FS_File open_file(const char *filename, int mode)
     int handle = get_handle();
     if (handle == 0)
     {
-        printf("%s: Could not find handle for file %s\n", __FUNCTION__, filename);
+        LOG_T4_WARN("%s: Could not find handle for file %s\n", __FUNCTION__, filename);
         return 0;
     }
     fp[handle] = SD.open(filename, mode);
     if (!fp[handle])
     {
-        printf("%s: Could not open file %s\n", __FUNCTION__, filename);
+        LOG_T4_WARN("%s: Could not open file %s\n", __FUNCTION__, filename);
         return 0;
     }
+
+    uint32_t name[2] = {0, 0};
+    strncpy((char *)name, filename, sizeof(name));
+    REC_T4_Record(REC_T4_FS_OPEN, handle, name[0], name[1]);
     return handle;
 }
 
@@ -150,12 +868,19 @@ FLASHMEM FS_File FS_OpenOmniFile(const char *filename)
 
 FLASHMEM FS_File FS_OpenUserFile(const char *filename)
 {
-    return open_file(filename, FILE_READ);
+    return FS_T4_UserOpen(filename);
 }
 
 FLASHMEM FS_File FS_CreateUserFile(const char *filename)
 {
-    return open_file(filename, FILE_WRITE_BEGIN);
+    const uint32_t capacity = 16 * 1024;
+    uint8_t *data = FS_T4_UserAlloc(capacity);
+    if (data == NULL)
+    {
+        LOG_T4_WARN("%s: Could not allocate a buffer for %s\n", __FUNCTION__, filename);
+        return 0;
+    }
+    return FS_T4_UserHandle(filename, data, 0, capacity, true);
 }
 
 FLASHMEM bool FS_IsKeenFilePresent(const char *filename)
@@ -182,6 +907,11 @@ FLASHMEM bool FS_IsOmniFilePresent(const char *filename)
 
 FLASHMEM bool FS_IsUserFilePresent(const char *filename)
 {
+    if (FS_T4_CommitFind(filename))
+    {
+        return true;
+    }
+    FS_T4_UserRecover(filename);
     int handle = open_file(filename, FILE_READ);
     if (handle)
     {
@@ -331,6 +1061,7 @@ FLASHMEM bool FS_LoadUserFile(const char *filename, mm_ptr_t *ptr, int *memsize)
     int length = FS_GetFileSize(handle);
 
     MM_GetPtr(ptr, length);
+    MEM_T4_TrackAlloc(*ptr, length, MEM_T4_TAG_USERFILE);
 
     if (memsize)
         *memsize = length;
@@ -342,3 +1073,653 @@ FLASHMEM bool FS_LoadUserFile(const char *filename, mm_ptr_t *ptr, int *memsize)
         return false;
     return true;
 }
+
+//Pre-decoded asset pack, see id_fs_t4_pack.h and tools/t4pack.c. If the pack is on the SD card, graphics
+//chunks and map planes are read from it straight into their final buffers and id_ca has nothing left to
+//decompress. Anything missing from the pack, or a pack that doesn't match the game files, falls back to id_ca.
+static struct
+{
+    bool tried;
+    FS_File handle;
+    T4_PackEntry *index;
+    uint32_t num_entries;
+    uint8_t *scratch;
+    uint32_t scratch_size;
+    uint32_t loads, bytes_read, bytes_expanded, us;
+} pack;
+
+//Level prefetch. While Keen is on the world map near a level entrance, that level's map planes, and the graphics
+//it needed last time it was loaded, are copied from the pack into PSRAM in idle time. Entering the level then
+//only has to expand them from PSRAM.
+#ifndef FS_T4_PREFETCH_BUDGET
+#define FS_T4_PREFETCH_BUDGET (1024 * 1024) //Bytes of PSRAM for prefetched entries
+#endif
+#define FS_T4_PREFETCH_RADIUS 4   //Tiles around Keen to look for a level entrance
+#define FS_T4_WORLD_MAP 0
+static struct
+{
+    uint8_t **data;         //Per pack entry, set once the entry has been completely prefetched
+    uint32_t bytes;
+    int target;             //Level being prefetched, -1 for none
+    uint16_t *list;         //Pack entries to prefetch for the target
+    int list_len, list_pos;
+    uint8_t *current;       //Entry being read
+    uint32_t read_id;
+    int keen_tx, keen_ty;
+    uint16_t *marks[CA_NUMMAPS]; //Graphics chunks each level needed last time it was loaded
+    uint16_t num_marks[CA_NUMMAPS];
+    uint32_t hits, misses, entries, bytes_fetched, us;
+} prefetch = {.target = -1, .keen_tx = -1};
+
+FLASHMEM static uint32_t FS_T4_KeenFileSize(const char *filename)
+{
+    FS_File handle = FS_OpenKeenFile(FS_AdjustExtension(filename));
+    if (handle == 0)
+    {
+        return 0;
+    }
+    uint32_t size = FS_GetFileSize(handle);
+    FS_CloseFile(handle);
+    return size;
+}
+
+//Opened on first use, as the episode isn't known until then.
+FLASHMEM static bool FS_T4_PackOpen()
+{
+    if (pack.tried)
+    {
+        return pack.index != NULL;
+    }
+    pack.tried = true;
+
+    char name[16];
+    strcpy(name, FS_AdjustExtension(T4_PACK_NAME));
+    if (!SD.exists(name))
+    {
+        return false;
+    }
+    pack.handle = open_file(name, FILE_READ);
+    T4_PackHeader header;
+    if (pack.handle == 0 || FS_Read(&header, sizeof(header), 1, pack.handle) != 1 ||
+        header.magic != T4_PACK_MAGIC || header.version != T4_PACK_VERSION)
+    {
+        LOG_T4_WARN("FS: %s is not a valid asset pack\n", name);
+        FS_CloseFile(pack.handle);
+        return false;
+    }
+    if (strncmp(header.ext, ck_currentEpisode->ext, 3) != 0 ||
+        header.graph_size != FS_T4_KeenFileSize("EGAGRAPH.CK4") ||
+        header.maps_size != FS_T4_KeenFileSize("GAMEMAPS.CK4"))
+    {
+        LOG_T4_WARN("FS: %s was built from different game files, ignoring it\n", name);
+        FS_CloseFile(pack.handle);
+        return false;
+    }
+
+    uint32_t bytes = header.num_entries * sizeof(T4_PackEntry);
+    T4_PackEntry *index = (T4_PackEntry *)extmem_malloc(bytes);
+    if (index == NULL || FS_Read(index, bytes, 1, pack.handle) != 1)
+    {
+        LOG_T4_WARN("FS: Could not load the %lu byte asset pack index\n", bytes);
+        extmem_free(index);
+        FS_CloseFile(pack.handle);
+        return false;
+    }
+    MEM_T4_TrackAlloc(index, bytes, MEM_T4_TAG_CACHE);
+    pack.index = index;
+    pack.num_entries = header.num_entries;
+    LOG_T4_INFO("FS: Using asset pack %s with %lu entries\n", name, pack.num_entries);
+    return true;
+}
+
+static const T4_PackEntry *FS_T4_PackFind(int type, int id)
+{
+    int lo = 0, hi = (int)pack.num_entries - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        const T4_PackEntry *e = &pack.index[mid];
+        int cmp = (e->type != type) ? e->type - type : e->id - id;
+        if (cmp == 0)
+        {
+            return e;
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+//Kept for good rather than allocated per block, so background saves don't churn the heap
+#define FS_T4_LZ4_HASH_BITS 12
+static DMAMEM int32_t lz4_table[1 << FS_T4_LZ4_HASH_BITS];
+
+//LZ4 block format, the same greedy compressor as tools/t4pack.c with a smaller hash table. Returns 0 if the
+//result wouldn't be smaller than the input.
+static uint32_t FS_T4_LZ4Compress(const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+    const int HASH_BITS = FS_T4_LZ4_HASH_BITS;
+    int32_t *table = lz4_table;
+    memset(table, 0xFF, sizeof(lz4_table));
+    uint32_t in = 0, anchor = 0, out = 0;
+    uint32_t limit = len > 12 ? len - 12 : 0; //The last match has to end 5 bytes before the end
+
+    while (in < limit)
+    {
+        uint32_t seq;
+        memcpy(&seq, &src[in], 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        int32_t ref = table[h];
+        table[h] = in;
+        if (ref < 0 || in - ref > 0xFFFF || memcmp(&src[ref], &seq, 4) != 0)
+        {
+            in++;
+            continue;
+        }
+
+        uint32_t match = 4;
+        while (in + match < len - 5 && src[ref + match] == src[in + match])
+            match++;
+
+        uint32_t literals = in - anchor;
+        if (out + literals + literals / 255 + 16 >= len)
+        {
+            return 0;
+        }
+        uint8_t *token = &dst[out++];
+        *token = (literals < 15 ? literals : 15) << 4;
+        if (literals >= 15)
+        {
+            uint32_t n = literals - 15;
+            for (; n >= 255; n -= 255)
+                dst[out++] = 255;
+            dst[out++] = n;
+        }
+        memcpy(&dst[out], &src[anchor], literals);
+        out += literals;
+        dst[out++] = (in - ref) & 0xFF;
+        dst[out++] = (in - ref) >> 8;
+        uint32_t m = match - 4;
+        *token |= m < 15 ? m : 15;
+        if (m >= 15)
+        {
+            m -= 15;
+            for (; m >= 255; m -= 255)
+                dst[out++] = 255;
+            dst[out++] = m;
+        }
+        in += match;
+        anchor = in;
+    }
+
+    uint32_t literals = len - anchor;
+    if (out + literals + literals / 255 + 2 >= len)
+    {
+        return 0;
+    }
+    dst[out++] = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15)
+    {
+        uint32_t n = literals - 15;
+        for (; n >= 255; n -= 255)
+            dst[out++] = 255;
+        dst[out++] = n;
+    }
+    memcpy(&dst[out], &src[anchor], literals);
+    return out + literals;
+}
+
+//LZ4 block format. Returns the number of bytes written, which is less than dst_len if the data is bad.
+static uint32_t FS_T4_LZ4Decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t dst_len)
+{
+    uint32_t in = 0, out = 0;
+    while (in < len)
+    {
+        uint8_t token = src[in++];
+        uint32_t n = token >> 4;
+        if (n == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (in >= len)
+                {
+                    return out;
+                }
+                b = src[in++];
+                n += b;
+            } while (b == 255);
+        }
+        if (out + n > dst_len || in + n > len)
+        {
+            return out;
+        }
+        memcpy(&dst[out], &src[in], n);
+        in += n;
+        out += n;
+        if (in + 2 > len)
+        {
+            break;
+        }
+
+        uint32_t offset = src[in] | (src[in + 1] << 8);
+        in += 2;
+        n = (token & 0xF) + 4;
+        if ((token & 0xF) == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (in >= len)
+                {
+                    return out;
+                }
+                b = src[in++];
+                n += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > out || out + n > dst_len)
+        {
+            return out;
+        }
+        for (uint32_t i = 0; i < n; i++, out++)
+        {
+            dst[out] = dst[out - offset];
+        }
+    }
+    return out;
+}
+
+//Read a pack entry into a new MM buffer. Returns false, with nothing allocated, if it can't.
+static bool FS_T4_PackLoad(int type, int id, mm_ptr_t *ptr, uint32_t expected)
+{
+    const T4_PackEntry *e = FS_T4_PackFind(type, id);
+    if (e == NULL || (expected && e->expanded != expected))
+    {
+        return false;
+    }
+
+    uint32_t start = micros();
+    int entry = e - pack.index;
+    uint8_t *prefetched = prefetch.data ? prefetch.data[entry] : NULL;
+    if (ca_mapOn == prefetch.target)
+    {
+        (prefetched ? prefetch.hits : prefetch.misses)++;
+    }
+    if (prefetched)
+    {
+        MM_GetPtr(ptr, e->expanded);
+        if (e->flags & T4_PACK_LZ4)
+        {
+            if (FS_T4_LZ4Decompress(prefetched, e->size, (uint8_t *)*ptr, e->expanded) != e->expanded)
+            {
+                LOG_T4_ERROR("FS: Prefetched asset pack entry %d:%d is damaged\n", type, id);
+                MM_FreePtr(ptr);
+                extmem_free(prefetched);
+                prefetch.data[entry] = NULL;
+                return false;
+            }
+        }
+        else
+        {
+            memcpy(*ptr, prefetched, e->size);
+        }
+        pack.loads++;
+        pack.bytes_expanded += e->expanded;
+        pack.us += micros() - start;
+        return true;
+    }
+
+    uint8_t *src = NULL;
+    if (e->flags & T4_PACK_LZ4)
+    {
+        if (e->size > pack.scratch_size)
+        {
+            uint8_t *p = (uint8_t *)extmem_realloc(pack.scratch, e->size);
+            if (p == NULL)
+            {
+                return false;
+            }
+            pack.scratch = p;
+            pack.scratch_size = e->size;
+        }
+        src = pack.scratch;
+    }
+
+    MM_GetPtr(ptr, e->expanded);
+    bool ok = FS_T4_ReadWait(FS_T4_ReadSubmit(pack.handle, e->offset, src ? src : *ptr, e->size)) == e->size;
+    if (ok && src)
+    {
+        ok = FS_T4_LZ4Decompress(src, e->size, (uint8_t *)*ptr, e->expanded) == e->expanded;
+    }
+    if (!ok)
+    {
+        LOG_T4_ERROR("FS: Could not load asset pack entry %d:%d\n", type, id);
+        MM_FreePtr(ptr);
+        return false;
+    }
+
+    pack.loads++;
+    pack.bytes_read += e->size;
+    pack.bytes_expanded += e->expanded;
+    pack.us += micros() - start;
+    return true;
+}
+
+FLASHMEM static void FS_T4_PrefetchClear()
+{
+    for (int i = 0; i < prefetch.list_len && prefetch.data; i++)
+    {
+        uint16_t entry = prefetch.list[i];
+        extmem_free(prefetch.data[entry]);
+        prefetch.data[entry] = NULL;
+    }
+    if (prefetch.current)
+    {
+        FS_T4_ReadCancel(prefetch.read_id);
+        FS_T4_ReadWait(prefetch.read_id);
+        extmem_free(prefetch.current);
+        prefetch.current = NULL;
+    }
+    prefetch.list_len = 0;
+    prefetch.list_pos = 0;
+    prefetch.bytes = 0;
+    prefetch.target = -1;
+}
+
+FLASHMEM static void FS_T4_PrefetchAdd(int type, int id)
+{
+    const T4_PackEntry *e = FS_T4_PackFind(type, id);
+    if (e != NULL && prefetch.bytes + e->size <= FS_T4_PREFETCH_BUDGET)
+    {
+        prefetch.list[prefetch.list_len++] = e - pack.index;
+        prefetch.bytes += e->size;
+    }
+}
+
+FLASHMEM static void FS_T4_PrefetchSetTarget(int level)
+{
+    FS_T4_PrefetchClear();
+    if (prefetch.data == NULL)
+    {
+        prefetch.data = (uint8_t **)extmem_calloc(pack.num_entries, sizeof(uint8_t *));
+        prefetch.list = (uint16_t *)extmem_malloc(pack.num_entries * sizeof(uint16_t));
+        if (prefetch.data == NULL || prefetch.list == NULL)
+        {
+            return;
+        }
+    }
+
+    //Map planes first as they're always needed, then the graphics in the order they were loaded last time
+    prefetch.target = level;
+    for (int plane = 0; plane < CA_NUMMAPPLANES; plane++)
+    {
+        FS_T4_PrefetchAdd(T4_PACK_MAP, level * CA_NUMMAPPLANES + plane);
+    }
+    for (int i = 0; i < prefetch.num_marks[level]; i++)
+    {
+        FS_T4_PrefetchAdd(T4_PACK_GRAPHICS, prefetch.marks[level][i]);
+    }
+}
+
+//Pick the level entrance closest to Keen on the world map, if any are close enough.
+static void FS_T4_PrefetchUpdateTarget()
+{
+    CA_MapHeader *header = CA_MapHeaders[FS_T4_WORLD_MAP];
+    if (ca_mapOn != FS_T4_WORLD_MAP || ck_keenObj == NULL || header == NULL || CA_mapPlanes[2] == NULL)
+    {
+        return;
+    }
+    int keen_tx = ck_keenObj->posX >> 8, keen_ty = ck_keenObj->posY >> 8;
+    if (keen_tx == prefetch.keen_tx && keen_ty == prefetch.keen_ty)
+    {
+        return;
+    }
+    prefetch.keen_tx = keen_tx;
+    prefetch.keen_ty = keen_ty;
+
+    int best = -1, best_dist = 0;
+    for (int ty = keen_ty - FS_T4_PREFETCH_RADIUS; ty <= keen_ty + FS_T4_PREFETCH_RADIUS; ty++)
+    {
+        for (int tx = keen_tx - FS_T4_PREFETCH_RADIUS; tx <= keen_tx + FS_T4_PREFETCH_RADIUS; tx++)
+        {
+            if (tx < 0 || ty < 0 || tx >= header->width || ty >= header->height)
+            {
+                continue;
+            }
+            //Entrances are marked in the info plane with 0xC000 plus the level number
+            uint16_t info = CA_mapPlanes[2][ty * header->width + tx];
+            int level = info & 0xFF;
+            int dist = (tx - keen_tx) * (tx - keen_tx) + (ty - keen_ty) * (ty - keen_ty);
+            if ((info & 0xFF00) == 0xC000 && level > 0 && level < CA_NUMMAPS && (best < 0 || dist < best_dist))
+            {
+                best = level;
+                best_dist = dist;
+            }
+        }
+    }
+    if (best >= 0 && best != prefetch.target)
+    {
+        FS_T4_PrefetchSetTarget(best);
+    }
+}
+
+//Remember the graphics a level needs so they can be prefetched next time Keen is near its entrance.
+FLASHMEM static void FS_T4_PrefetchRecordMarks(int level)
+{
+    if (level <= FS_T4_WORLD_MAP || level >= CA_NUMMAPS)
+    {
+        return;
+    }
+    int count = 0;
+    for (int chunk = 0; chunk < CA_MAX_GRAPH_CHUNKS; chunk++)
+    {
+        count += (ca_graphChunkNeeded[chunk] & ca_levelbit) && FS_T4_PackFind(T4_PACK_GRAPHICS, chunk);
+    }
+    uint16_t *marks = (uint16_t *)extmem_realloc(prefetch.marks[level], (count + 1) * sizeof(uint16_t));
+    if (marks == NULL)
+    {
+        prefetch.num_marks[level] = 0;
+        return;
+    }
+    prefetch.marks[level] = marks;
+    prefetch.num_marks[level] = 0;
+    for (int chunk = 0; chunk < CA_MAX_GRAPH_CHUNKS; chunk++)
+    {
+        if ((ca_graphChunkNeeded[chunk] & ca_levelbit) && FS_T4_PackFind(T4_PACK_GRAPHICS, chunk))
+        {
+            marks[prefetch.num_marks[level]++] = chunk;
+        }
+    }
+}
+
+void FS_T4_Poll(uint32_t budget_us)
+{
+    uint32_t start = micros();
+    FS_T4_CommitService(budget_us);
+    if (pack.index)
+    {
+        FS_T4_PrefetchUpdateTarget();
+    }
+
+    while (micros() - start < budget_us)
+    {
+        //Prefetch one entry at a time, queued behind any other reads
+        if (prefetch.current == NULL && prefetch.list_pos < prefetch.list_len)
+        {
+            const T4_PackEntry *e = &pack.index[prefetch.list[prefetch.list_pos]];
+            prefetch.current = (uint8_t *)extmem_malloc(e->size);
+            if (prefetch.current == NULL)
+            {
+                prefetch.list_len = prefetch.list_pos;
+                break;
+            }
+            prefetch.read_id = FS_T4_ReadSubmit(pack.handle, e->offset, prefetch.current, e->size);
+        }
+
+        uint32_t steps = reads.steps;
+        uint32_t elapsed = micros() - start;
+        FS_T4_ReadService(budget_us > elapsed ? budget_us - elapsed : 0);
+
+        uint32_t bytes;
+        if (prefetch.current && FS_T4_ReadPoll(prefetch.read_id, &bytes))
+        {
+            uint16_t entry = prefetch.list[prefetch.list_pos];
+            if (bytes != pack.index[entry].size)
+            {
+                //Give up on this level, it will be loaded normally
+                extmem_free(prefetch.current);
+                prefetch.current = NULL;
+                FS_T4_PrefetchClear();
+                break;
+            }
+            prefetch.data[entry] = prefetch.current;
+            prefetch.current = NULL;
+            prefetch.list_pos++;
+            prefetch.entries++;
+            prefetch.bytes_fetched += bytes;
+        }
+        else if (reads.steps == steps)
+        {
+            //Nothing more fits in the budget
+            break;
+        }
+    }
+    prefetch.us += micros() - start;
+}
+
+FLASHMEM static void FS_T4_PackPrintStats()
+{
+    if (pack.index == NULL)
+    {
+        printf("FS: No asset pack in use\n");
+        return;
+    }
+    printf("FS: Asset pack %lu loads, %lu bytes read, %lu expanded, %lu us (%lu KB/s)\n", pack.loads, pack.bytes_read,
+           pack.bytes_expanded, pack.us, pack.us ? (uint32_t)((uint64_t)pack.bytes_read * 1000000 / 1024 / pack.us) : 0);
+    uint32_t loads = CK_Cross_max(1, prefetch.hits + prefetch.misses);
+    printf("FS: Prefetch target %d, %d/%d entries, %lu entries %lu bytes fetched in %lu us\n", prefetch.target,
+           prefetch.list_pos, prefetch.list_len, prefetch.entries, prefetch.bytes_fetched, prefetch.us);
+    printf("FS: Prefetch hit rate %lu%% (%lu hits, %lu misses)\n", prefetch.hits * 100 / loads, prefetch.hits,
+           prefetch.misses);
+}
+
+//id_ca is hooked with -Wl,--wrap. Chunks are put in place before the real functions run, so they find the
+//chunk already cached and only do their bookkeeping.
+extern "C" void __real_CA_CacheGrChunk(int chunk);
+extern "C" void __wrap_CA_CacheGrChunk(int chunk)
+{
+    if (chunk >= 0 && chunk < CA_MAX_GRAPH_CHUNKS && !ca_graphChunks[chunk] && FS_T4_PackOpen())
+    {
+        FS_T4_PackLoad(T4_PACK_GRAPHICS, chunk, &ca_graphChunks[chunk], 0);
+    }
+    __real_CA_CacheGrChunk(chunk);
+}
+
+//CA_CacheMarks loads the level's graphics in one go, without going through the wrapped CA_CacheGrChunk.
+extern "C" void __real_CA_CacheMarks(const char *msg);
+extern "C" void __wrap_CA_CacheMarks(const char *msg)
+{
+    if (FS_T4_PackOpen())
+    {
+        FS_T4_PrefetchRecordMarks(ca_mapOn);
+
+        for (int chunk = 0; chunk < CA_MAX_GRAPH_CHUNKS; chunk++)
+        {
+            if ((ca_graphChunkNeeded[chunk] & ca_levelbit) && !ca_graphChunks[chunk])
+            {
+                FS_T4_PackLoad(T4_PACK_GRAPHICS, chunk, &ca_graphChunks[chunk], 0);
+            }
+        }
+    }
+    __real_CA_CacheMarks(msg);
+}
+
+#ifndef FS_T4_PACK_VERIFY
+#define FS_T4_PACK_VERIFY 0 //1 also loads every map through id_ca and checks the pack gave the same result
+#endif
+
+extern "C" void __real_CA_CacheMap(int mapIndex);
+
+#if FS_T4_PACK_VERIFY
+//Reload the map with the real CA_CacheMap, keeping its planes, and compare them with the pack's
+FLASHMEM static void FS_T4_PackVerifyMap(int mapIndex)
+{
+    uint16_t *packed[CA_NUMMAPPLANES];
+    for (int plane = 0; plane < CA_NUMMAPPLANES; plane++)
+    {
+        packed[plane] = CA_mapPlanes[plane];
+        CA_mapPlanes[plane] = NULL;
+    }
+    __real_CA_CacheMap(mapIndex);
+
+    uint32_t plane_size = CA_MapHeaders[mapIndex]->width * CA_MapHeaders[mapIndex]->height * 2;
+    for (int plane = 0; plane < CA_NUMMAPPLANES; plane++)
+    {
+        if (ca_mapOn != mapIndex || CA_mapPlanes[plane] == NULL || memcmp(packed[plane], CA_mapPlanes[plane], plane_size))
+        {
+            LOG_T4_ERROR("FS: Map %d plane %d from the asset pack doesn't match id_ca\n", mapIndex, plane);
+        }
+        MM_FreePtr((mm_ptr_t *)&packed[plane]);
+    }
+}
+#endif
+
+//Stands in for CA_CacheMap when the pack has every plane of the map, and leaves the same state the real one
+//does: the previous planes freed with MM_FreePtr, ca_mapOn set, and each plane a width * height * 2 byte
+//MM_GetPtr block holding the expanded plane, with purge and lock state left as MM_GetPtr set them. Anything
+//else, including a plane that fails to load, goes to the real function. Build with FS_T4_PACK_VERIFY=1 to
+//check the two against each other.
+extern "C" void __wrap_CA_CacheMap(int mapIndex)
+{
+    CA_MapHeader *header = (mapIndex >= 0 && mapIndex < CA_NUMMAPS) ? CA_MapHeaders[mapIndex] : NULL;
+    bool in_pack = header != NULL && FS_T4_PackOpen();
+    for (int plane = 0; in_pack && plane < CA_NUMMAPPLANES; plane++)
+    {
+        in_pack = FS_T4_PackFind(T4_PACK_MAP, mapIndex * CA_NUMMAPPLANES + plane) != NULL;
+    }
+    if (!in_pack)
+    {
+        __real_CA_CacheMap(mapIndex);
+        return;
+    }
+
+    for (int plane = 0; plane < CA_NUMMAPPLANES; plane++)
+    {
+        if (CA_mapPlanes[plane])
+        {
+            MM_FreePtr((mm_ptr_t *)&CA_mapPlanes[plane]);
+        }
+    }
+    ca_mapOn = mapIndex;
+
+    uint32_t plane_size = header->width * header->height * 2;
+    for (int plane = 0; plane < CA_NUMMAPPLANES; plane++)
+    {
+        if (!FS_T4_PackLoad(T4_PACK_MAP, mapIndex * CA_NUMMAPPLANES + plane, (mm_ptr_t *)&CA_mapPlanes[plane], plane_size))
+        {
+            //The real one frees whatever was loaded and starts over
+            __real_CA_CacheMap(mapIndex);
+            return;
+        }
+    }
+#if FS_T4_PACK_VERIFY
+    FS_T4_PackVerifyMap(mapIndex);
+#endif
+}
+
+//Quitting and the end of the demo loop both shut down through CK_ShutdownID, which calls MM_Shutdown. Saves still
+//queued then, such as the config written on the way out, would otherwise never reach the SD card.
+extern "C" void __real_MM_Shutdown(void);
+extern "C" void __wrap_MM_Shutdown(void)
+{
+    commits.shutdown = true;
+    FS_T4_CommitFlush();
+    __real_MM_Shutdown();
+}
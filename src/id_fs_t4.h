@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_FS_T4_H
+#define ID_FS_T4_H
+
+#include <stdint.h>
+
+//Background work for the FS layer, such as prefetching the next level and writing saved games to the SD
+//card. Called while idle and returns within budget_us.
+void FS_T4_Poll(uint32_t budget_us);
+
+//Asynchronous reads, serviced in order in idle time or while waiting on one. handle is an FS_File and dst has
+//to stay valid until the read finishes. Returns an id to poll or wait on.
+#define FS_T4_MAX_READS 8
+uint32_t FS_T4_ReadSubmit(int handle, uint32_t offset, void *dst, uint32_t size);
+//True once the read has finished, with bytes set to the amount read. A result is kept until
+//FS_T4_MAX_READS more reads have been submitted.
+bool FS_T4_ReadPoll(uint32_t id, uint32_t *bytes);
+//Service the queue until the read has finished, and return the amount read.
+uint32_t FS_T4_ReadWait(uint32_t id);
+//Stop a read early. It still has to finish before dst can be reused.
+void FS_T4_ReadCancel(uint32_t id);
+
+#endif
@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_FS_T4_PACK_H
+#define ID_FS_T4_PACK_H
+
+#include <stdint.h>
+
+//Pre-decoded asset pack, built offline by tools/t4pack.c and read by id_fs_t4.cpp.
+//
+//The file starts with a T4_PackHeader, followed by num_entries T4_PackEntry records sorted by
+//type then id. Entry data starts on a multiple of the alignment (512 by default, one SD sector)
+//and is either stored as is or LZ4 block compressed. Graphics chunks are stored exactly as
+//id_ca would hold them after Huffman expansion, and map planes after Carmack and RLEW expansion.
+//All values are little endian.
+
+#define T4_PACK_MAGIC 0x4B503454 //"T4PK"
+#define T4_PACK_VERSION 1
+#define T4_PACK_NAME "T4PACK.CK4" //Extension is adjusted to the episode
+
+#define T4_PACK_GRAPHICS 0 //id is the graphics chunk number
+#define T4_PACK_MAP 1      //id is map number * 3 + plane
+
+#define T4_PACK_LZ4 0x01
+
+typedef struct T4_PackHeader
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t alignment;
+    uint32_t num_entries;
+    uint32_t graph_size; //Size of the EGAGRAPH file the pack was built from, to catch a stale pack
+    uint32_t maps_size;  //Size of the GAMEMAPS file the pack was built from
+    char ext[4];         //Episode extension, "CK4" etc
+    uint32_t reserved[2];
+} T4_PackHeader;
+
+typedef struct T4_PackEntry
+{
+    uint8_t type;
+    uint8_t flags;
+    uint16_t id;
+    uint32_t offset;
+    uint32_t size;     //Bytes stored in the pack
+    uint32_t expanded; //Bytes once decompressed
+} T4_PackEntry;
+
+#endif
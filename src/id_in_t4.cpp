@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <Arduino.h>
 #include "USBHost_t36.h"
+#include "id_in_t4.h"
 
 extern "C"
 {
@@ -16,6 +17,7 @@ JoystickController joy1(usbh);
 static uint32_t new_b = 0;
 static uint32_t delta_b = 0;
 static int16_t x_axis = 0, y_axis = 0;
+static bool usb_started = false;
 
 static void IN_T4_PumpEvents()
 {
@@ -49,9 +51,19 @@ static void IN_T4_WaitKey()
     return;
 }
 
+//Start the USB host early so devices enumerate in the background while the rest of boot runs.
+void IN_T4_BeginEnumeration()
+{
+    if (!usb_started)
+    {
+        usbh.begin();
+        usb_started = true;
+    }
+}
+
 static void IN_T4_Startup(bool disableJoysticks)
 {
-    usbh.begin();
+    IN_T4_BeginEnumeration();
     IN_SetControlType(0, IN_ctrl_Joystick1);
     IN_SetJoyConf(IN_joy_jump, IN_joy_jump);
     IN_SetJoyConf(IN_joy_pogo, IN_joy_pogo);
@@ -0,0 +1,8 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_IN_T4_H
+#define ID_IN_T4_H
+
+//Start the USB host so controllers enumerate in the background. Safe to call more than once.
+void IN_T4_BeginEnumeration();
+
+#endif
@@ -0,0 +1,236 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <Arduino.h>
+#include "id_log_t4.h"
+#include "id_con_t4.h"
+
+extern "C"
+{
+#include "printf.h"
+#include "ck_cross.h"
+}
+
+//Longest text message. Longer ones are cut short.
+static const int MAX_LINE = 128;
+
+static const char level_chars[] = {' ', 'E', 'W', 'I', 'D'};
+static const char *level_names[] = {"none", "error", "warn", "info", "debug"};
+
+//Serial1 already has a single producer, single consumer ring drained by its TX interrupt. It is
+//extended rather than adding a second ring in front of it.
+static DMAMEM uint8_t log_buffer[LOG_T4_BUFFER_SIZE];
+
+static struct
+{
+    int level; //Runtime filter, at most LOG_T4_LEVEL
+    int capacity;
+    uint32_t messages;
+    uint32_t bytes;
+    uint32_t dropped;
+    uint32_t dropped_bytes;
+    uint32_t reported; //Drops already reported in the log
+    uint32_t peak;     //Most bytes waiting to be sent
+} log_state = {LOG_T4_LEVEL};
+
+//Queues a whole message or nothing. Serial1.write only waits when its ring is full, and that is
+//checked first unless wait is set.
+static bool LOG_T4_Send(const void *data, int len, bool wait)
+{
+    int room = Serial1.availableForWrite();
+    if (len > room && !wait)
+    {
+        return false;
+    }
+    Serial1.write((const uint8_t *)data, len);
+
+    uint32_t waiting = log_state.capacity - room + len;
+    if (waiting > log_state.peak)
+    {
+        log_state.peak = waiting;
+    }
+    log_state.messages++;
+    log_state.bytes += len;
+    return true;
+}
+
+#if LOG_T4_BINARY
+//Copies the arguments as raw words, using the conversions in the format string to find their size.
+static int LOG_T4_PackArgs(const char *fmt, va_list args, uint32_t *words)
+{
+    int n = 0;
+    while (*fmt && n < LOG_T4_RECORD_MAX_ARGS)
+    {
+        if (*fmt++ != '%')
+        {
+            continue;
+        }
+        if (*fmt == '%')
+        {
+            fmt++;
+            continue;
+        }
+
+        //Flags, width and precision. '*' takes an int argument.
+        while (*fmt && strchr("-+ #0123456789.*", *fmt))
+        {
+            if (*fmt == '*' && n < LOG_T4_RECORD_MAX_ARGS)
+            {
+                words[n++] = va_arg(args, int);
+            }
+            fmt++;
+        }
+        int longs = 0;
+        while (*fmt && strchr("lhzjt", *fmt))
+        {
+            longs += (*fmt == 'l');
+            fmt++;
+        }
+
+        char conv = *fmt;
+        if (conv == '\0' || n == LOG_T4_RECORD_MAX_ARGS)
+        {
+            break;
+        }
+        fmt++;
+
+        uint64_t wide;
+        if (strchr("fFeEgG", conv))
+        {
+            double d = va_arg(args, double);
+            memcpy(&wide, &d, sizeof(wide));
+        }
+        else if (longs >= 2)
+        {
+            wide = va_arg(args, unsigned long long);
+        }
+        else
+        {
+            if (conv == 's')
+            {
+                const char *str = va_arg(args, const char *);
+                str = str ? str : "(null)";
+                uint32_t len = CK_Cross_min((uint32_t)strlen(str), (uint32_t)(LOG_T4_RECORD_MAX_ARGS - n - 1) * 4);
+                words[n++] = len;
+                memset(&words[n], 0, (len + 3) / 4 * 4);
+                memcpy(&words[n], str, len);
+                n += (len + 3) / 4;
+            }
+            else if (conv == 'p')
+            {
+                words[n++] = (uint32_t)(uintptr_t)va_arg(args, const void *);
+            }
+            else
+            {
+                words[n++] = va_arg(args, unsigned int);
+            }
+            continue;
+        }
+
+        if (n + 2 > LOG_T4_RECORD_MAX_ARGS)
+        {
+            break;
+        }
+        words[n++] = (uint32_t)wide;
+        words[n++] = (uint32_t)(wide >> 32);
+    }
+    return n;
+}
+#endif
+
+static void LOG_T4_VWrite(int level, bool wait, const char *fmt, va_list args)
+{
+
+    //Report drops once there is room again, so a gap in the log is never silent
+    if (log_state.dropped != log_state.reported)
+    {
+        char note[48];
+        int len = snprintf(note, sizeof(note), "W LOG: %lu messages dropped\n", log_state.dropped - log_state.reported);
+        if (!LOG_T4_Send(note, len, wait))
+        {
+            log_state.dropped++;
+            return;
+        }
+        log_state.reported = log_state.dropped;
+    }
+
+    bool sent;
+#if LOG_T4_BINARY
+    LOG_T4_Record record;
+    record.sync = LOG_T4_RECORD_SYNC;
+    record.level = level;
+    record.us = micros();
+    record.fmt = (uint32_t)(uintptr_t)fmt;
+    record.num_args = LOG_T4_PackArgs(fmt, args, record.args);
+
+    const uint8_t *body = (const uint8_t *)&record.us;
+    int body_len = sizeof(record.us) + sizeof(record.fmt) + record.num_args * sizeof(uint32_t);
+    uint8_t sum = record.level + record.num_args;
+    for (int i = 0; i < body_len; i++)
+    {
+        sum += body[i];
+    }
+    record.checksum = sum;
+    int len = 4 + body_len;
+    sent = LOG_T4_Send(&record, len, wait);
+#else
+    char line[MAX_LINE];
+    line[0] = level_chars[level];
+    line[1] = ' ';
+    int len = vsnprintf(line + 2, sizeof(line) - 2, fmt, args) + 2;
+    if (len >= (int)sizeof(line))
+    {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+    sent = LOG_T4_Send(line, len, wait);
+#endif
+
+    if (!sent)
+    {
+        log_state.dropped++;
+        log_state.dropped_bytes += len;
+    }
+}
+
+void LOG_T4_Write(int level, const char *fmt, ...)
+{
+    if (level > log_state.level)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    LOG_T4_VWrite(level, false, fmt, args);
+    va_end(args);
+}
+
+//Logged as an error, but waits for room and then for everything queued to go out, as nothing may run after it
+void LOG_T4_WriteFatal(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    LOG_T4_VWrite(LOG_T4_LEVEL_ERROR, true, fmt, args);
+    va_end(args);
+    Serial1.flush();
+}
+
+FLASHMEM static void LOG_T4_PrintStats()
+{
+    printf("LOG: level %s, %lu messages, %lu bytes. %lu dropped (%lu bytes). Peak %lu of %d bytes queued\n",
+           level_names[log_state.level], log_state.messages, log_state.bytes, log_state.dropped,
+           log_state.dropped_bytes, log_state.peak, log_state.capacity);
+}
+
+//Steps down through the levels compiled in, wrapping back to LOG_T4_LEVEL after errors only
+FLASHMEM static void LOG_T4_CycleLevel()
+{
+    log_state.level = (log_state.level > LOG_T4_LEVEL_ERROR) ? log_state.level - 1 : LOG_T4_LEVEL;
+    printf("LOG: level %s\n", level_names[log_state.level]);
+}
+
+FLASHMEM void LOG_T4_Startup()
+{
+    Serial1.addMemoryForWrite(log_buffer, sizeof(log_buffer));
+    log_state.capacity = Serial1.availableForWrite();
+    CON_T4_Register('l', "Log counters", LOG_T4_PrintStats);
+    CON_T4_Register('L', "Cycle log level", LOG_T4_CycleLevel);
+}
@@ -0,0 +1,85 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_LOG_T4_H
+#define ID_LOG_T4_H
+
+#include <stdint.h>
+
+//Levelled diagnostics over Serial1 that never stall the game. Messages are queued in the Serial1
+//transmit ring, which the UART TX interrupt drains in the background. A message that doesn't fit
+//is dropped whole and counted instead of waiting for room. Send 'l' on the console for counters.
+//
+//Calls above LOG_T4_LEVEL are removed at compile time, arguments and all. With -DLOG_T4_BINARY=1
+//messages are sent as small binary records holding the format string address and raw arguments,
+//so nothing is formatted on the Teensy. Strings are copied into the record, as they are often in
+//RAM where the ELF can't show them. Decode a capture on a PC with tools/t4log.py.
+//
+//LOG_T4_FATAL is for errors the game can't go on from, such as just before it hangs. It waits for
+//room and for the message to be sent, so it is never dropped or left in the queue.
+//
+//Only call these from thread context, not from interrupts.
+
+#define LOG_T4_LEVEL_NONE 0
+#define LOG_T4_LEVEL_ERROR 1
+#define LOG_T4_LEVEL_WARN 2
+#define LOG_T4_LEVEL_INFO 3
+#define LOG_T4_LEVEL_DEBUG 4
+
+#ifndef LOG_T4_LEVEL
+#define LOG_T4_LEVEL LOG_T4_LEVEL_INFO
+#endif
+#ifndef LOG_T4_BINARY
+#define LOG_T4_BINARY 0
+#endif
+//Added to the Serial1 transmit buffer
+#ifndef LOG_T4_BUFFER_SIZE
+#define LOG_T4_BUFFER_SIZE 4096
+#endif
+
+//Binary record layout. Text printed with printf is still sent as is between records.
+#define LOG_T4_RECORD_SYNC 0x1E
+//In 32 bit words. 64 bit and double arguments use two, and strings a length word and then their bytes,
+//cut short to fit.
+#define LOG_T4_RECORD_MAX_ARGS 24
+
+typedef struct LOG_T4_Record
+{
+    uint8_t sync;
+    uint8_t level;
+    uint8_t num_args;
+    uint8_t checksum; //Sum of level, num_args and every byte after checksum
+    uint32_t us;      //micros() when logged
+    uint32_t fmt;     //Address of the format string
+    uint32_t args[LOG_T4_RECORD_MAX_ARGS];
+} LOG_T4_Record;
+
+void LOG_T4_Startup();
+void LOG_T4_Write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void LOG_T4_WriteFatal(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+#if LOG_T4_LEVEL >= LOG_T4_LEVEL_ERROR
+#define LOG_T4_FATAL(...) LOG_T4_WriteFatal(__VA_ARGS__)
+#define LOG_T4_ERROR(...) LOG_T4_Write(LOG_T4_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_T4_FATAL(...) do {} while (0)
+#define LOG_T4_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_T4_LEVEL >= LOG_T4_LEVEL_WARN
+#define LOG_T4_WARN(...) LOG_T4_Write(LOG_T4_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_T4_WARN(...) do {} while (0)
+#endif
+
+#if LOG_T4_LEVEL >= LOG_T4_LEVEL_INFO
+#define LOG_T4_INFO(...) LOG_T4_Write(LOG_T4_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_T4_INFO(...) do {} while (0)
+#endif
+
+#if LOG_T4_LEVEL >= LOG_T4_LEVEL_DEBUG
+#define LOG_T4_DEBUG(...) LOG_T4_Write(LOG_T4_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_T4_DEBUG(...) do {} while (0)
+#endif
+
+#endif
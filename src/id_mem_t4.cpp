@@ -0,0 +1,279 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <Arduino.h>
+#include <malloc.h>
+#include "smalloc.h"
+#include "id_mem_t4.h"
+#include "id_con_t4.h"
+#include "id_rec_t4.h"
+#include "id_vl_t4_cache.h"
+
+extern "C"
+{
+#include "printf.h"
+#include "id_mm.h"
+#include "ck_cross.h"
+
+void __real_MM_GetPtr(mm_ptr_t *ptr, unsigned long size);
+void __real_MM_FreePtr(mm_ptr_t *ptr);
+
+//Provided by the Teensy core and linker script
+extern unsigned long _heap_start;
+extern unsigned long _heap_end;
+extern unsigned long _ebss;
+extern char *__brkval;
+extern uint8_t external_psram_size;
+extern struct smalloc_pool extmem_smalloc_pool;
+}
+
+#ifndef MEM_T4_DUMP_INTERVAL_MS
+#define MEM_T4_DUMP_INTERVAL_MS 0 //0 to disable the periodic report
+#endif
+
+//Open addressing hash table of live allocations, keyed by pointer.
+#ifndef MEM_T4_MAX_TRACKED
+#define MEM_T4_MAX_TRACKED 1024 //Must be a power of 2
+#endif
+
+typedef struct MEM_T4_Entry
+{
+    const void *ptr; //NULL if empty, DELETED if removed
+    uint32_t size : 28;
+    uint32_t tag : 4;
+} MEM_T4_Entry;
+
+typedef struct MEM_T4_RegionStats
+{
+    size_t live;
+    size_t peak;
+    uint32_t allocs;
+    uint32_t frees;
+    size_t tag_live[MEM_T4_NUM_TAGS];
+} MEM_T4_RegionStats;
+
+static const void *const DELETED = (const void *)1;
+static MEM_T4_Entry entries[MEM_T4_MAX_TRACKED];
+static MEM_T4_RegionStats region_stats[MEM_T4_NUM_REGIONS];
+static uint32_t untracked = 0;
+static uint32_t mm_missed_frees = 0;
+
+static const char *region_names[MEM_T4_NUM_REGIONS] = {"RAM1", "RAM2", "EXTMEM", "OTHER"};
+static const char *tag_names[MEM_T4_NUM_TAGS] = {"surface", "mm", "userfile", "cache", "draw", "capture"};
+
+MEM_T4_Region MEM_T4_RegionOf(const void *ptr)
+{
+    uint32_t addr = (uint32_t)ptr;
+    if (addr >= 0x20000000 && addr < 0x20080000)
+        return MEM_T4_RAM1;
+    if (addr >= 0x20200000 && addr < 0x20280000)
+        return MEM_T4_RAM2;
+    if (addr >= 0x70000000 && addr < 0x71000000)
+        return MEM_T4_EXTMEM;
+    return MEM_T4_OTHER;
+}
+
+static MEM_T4_Entry *MEM_T4_Find(const void *ptr, bool insert)
+{
+    uint32_t hash = ((uint32_t)ptr >> 2) * 2654435761u;
+    MEM_T4_Entry *free_slot = NULL;
+    for (int i = 0; i < MEM_T4_MAX_TRACKED; i++)
+    {
+        MEM_T4_Entry *e = &entries[(hash + i) & (MEM_T4_MAX_TRACKED - 1)];
+        if (e->ptr == ptr)
+            return e;
+        if (e->ptr == DELETED && free_slot == NULL)
+            free_slot = e;
+        if (e->ptr == NULL)
+            return insert ? (free_slot ? free_slot : e) : NULL;
+    }
+    return insert ? free_slot : NULL;
+}
+
+void MEM_T4_TrackAlloc(const void *ptr, size_t size, MEM_T4_Tag tag)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    MEM_T4_Entry *e = MEM_T4_Find(ptr, true);
+    if (e == NULL)
+    {
+        untracked++;
+        return;
+    }
+
+    MEM_T4_RegionStats *stats = &region_stats[MEM_T4_RegionOf(ptr)];
+    if (e->ptr == ptr)
+    {
+        //Already tracked, just retag it
+        stats->live -= e->size;
+        stats->tag_live[e->tag] -= e->size;
+    }
+    else
+    {
+        stats->allocs++;
+    }
+    e->ptr = ptr;
+    e->size = size;
+    e->tag = tag;
+    REC_T4_Record(REC_T4_ALLOC, tag | (MEM_T4_RegionOf(ptr) << 8), size, (uint32_t)ptr);
+    stats->live += size;
+    stats->tag_live[tag] += size;
+    stats->peak = CK_Cross_max(stats->peak, stats->live);
+}
+
+void MEM_T4_TrackFree(const void *ptr)
+{
+    MEM_T4_Entry *e = (ptr != NULL) ? MEM_T4_Find(ptr, false) : NULL;
+    if (e == NULL)
+    {
+        return;
+    }
+
+    MEM_T4_RegionStats *stats = &region_stats[MEM_T4_RegionOf(ptr)];
+    stats->live -= e->size;
+    stats->tag_live[e->tag] -= e->size;
+    stats->frees++;
+    REC_T4_Record(REC_T4_FREE, e->tag | (MEM_T4_RegionOf(ptr) << 8), e->size, (uint32_t)ptr);
+    e->ptr = DELETED;
+}
+
+//Memory manager allocations are captured by wrapping MM_GetPtr and MM_FreePtr at link time (-Wl,--wrap).
+//The linker only redirects calls from other objects, so anything id_mm.c allocates or frees internally, such as
+//purging a block to make room, is never seen. A purged block stays counted as live until its address is handed
+//out again, which is counted in mm_missed_frees so the report can say how far the mm figures are out.
+//
+//Graphics chunks are mm blocks, and the graphics cache only knows them by address. Every block handed out is
+//invalidated in the cache, which also covers blocks purged inside id_mm.c, and blocks freed from outside are
+//invalidated straight away to release their entries.
+extern "C" void __wrap_MM_GetPtr(mm_ptr_t *ptr, unsigned long size)
+{
+    __real_MM_GetPtr(ptr, size);
+    if (*ptr != NULL && MEM_T4_Find(*ptr, false) != NULL)
+    {
+        mm_missed_frees++;
+    }
+    if (*ptr != NULL)
+    {
+        VL_T4_GfxCacheInvalidate(*ptr, size);
+    }
+    MEM_T4_TrackAlloc(*ptr, size, MEM_T4_TAG_MM);
+}
+
+extern "C" void __wrap_MM_FreePtr(mm_ptr_t *ptr)
+{
+    MEM_T4_Entry *e = (*ptr != NULL) ? MEM_T4_Find(*ptr, false) : NULL;
+    if (e != NULL)
+    {
+        VL_T4_GfxCacheInvalidate(*ptr, e->size);
+    }
+    MEM_T4_TrackFree(*ptr);
+    __real_MM_FreePtr(ptr);
+}
+
+//Find the largest block an allocator can still return by binary search. Only used on demand.
+FLASHMEM static size_t MEM_T4_LargestFree(void *(*alloc)(size_t), void (*release)(void *), size_t upper)
+{
+    size_t lo = 0, hi = upper;
+    while (hi - lo > 64)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        void *p = alloc(mid);
+        if (p)
+        {
+            release(p);
+            lo = mid;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+FLASHMEM static void MEM_T4_FreeStats(MEM_T4_Region region, size_t *total_free, size_t *largest_free)
+{
+    *total_free = 0;
+    *largest_free = 0;
+    if (region == MEM_T4_RAM1)
+    {
+        //No heap in RAM1, report the space between static data and the top of the stack.
+        uint32_t sp;
+        asm volatile("mov %0, sp" : "=r"(sp));
+        *total_free = sp - (uint32_t)&_ebss;
+        *largest_free = *total_free;
+    }
+    else if (region == MEM_T4_RAM2)
+    {
+        struct mallinfo mi = mallinfo();
+        size_t unallocated = (char *)&_heap_end - __brkval;
+        *total_free = mi.fordblks + unallocated;
+        *largest_free = MEM_T4_LargestFree(malloc, free, *total_free);
+    }
+    else if (region == MEM_T4_EXTMEM && external_psram_size)
+    {
+        size_t total, user, free_bytes;
+        int blocks;
+        sm_malloc_stats_pool(&extmem_smalloc_pool, &total, &user, &free_bytes, &blocks);
+        *total_free = free_bytes;
+        *largest_free = MEM_T4_LargestFree(extmem_malloc, extmem_free, free_bytes);
+    }
+}
+
+FLASHMEM void MEM_T4_Report()
+{
+    printf("MEM: region   live     peak     free     largest  frag\n");
+    for (int r = 0; r < MEM_T4_OTHER; r++)
+    {
+        MEM_T4_RegionStats *stats = &region_stats[r];
+        size_t total_free, largest_free;
+        MEM_T4_FreeStats((MEM_T4_Region)r, &total_free, &largest_free);
+        int frag = total_free ? 100 - (int)((uint64_t)largest_free * 100 / total_free) : 0;
+        printf("MEM: %-8s %-8u %-8u %-8u %-8u %d%%\n", region_names[r], stats->live, stats->peak,
+               total_free, largest_free, frag);
+        for (int t = 0; t < MEM_T4_NUM_TAGS; t++)
+        {
+            if (stats->tag_live[t])
+                printf("MEM:   %-10s %u\n", tag_names[t], stats->tag_live[t]);
+        }
+        printf("MEM:   %lu allocs, %lu frees\n", stats->allocs, stats->frees);
+    }
+    printf("MEM: RAM2 DMAMEM %u bytes, EXTMEM %u MB fitted\n",
+           (char *)&_heap_start - (char *)0x20200000, external_psram_size);
+    if (untracked)
+    {
+        printf("MEM: %lu allocations not tracked, increase MEM_T4_MAX_TRACKED\n", untracked);
+    }
+    printf("MEM: mm only counts MM_GetPtr/MM_FreePtr calls made outside id_mm.c. Blocks it frees itself stay live\n");
+    printf("MEM: here until reused, which has happened %lu times, so mm live and peak can read high.\n",
+           mm_missed_frees);
+}
+
+void MEM_T4_ReportCompact()
+{
+    printf("MEM:");
+    for (int r = 0; r < MEM_T4_OTHER; r++)
+    {
+        printf(" %s %u/%u", region_names[r], region_stats[r].live, region_stats[r].peak);
+    }
+    printf("\n");
+}
+
+FLASHMEM void MEM_T4_Startup()
+{
+    CON_T4_Register('m', "Memory map and fragmentation report", MEM_T4_Report);
+    CON_T4_Register('M', "Compact memory report (live/peak bytes)", MEM_T4_ReportCompact);
+}
+
+void MEM_T4_Poll()
+{
+#if MEM_T4_DUMP_INTERVAL_MS > 0
+    static uint32_t last_dump = 0;
+    if (millis() - last_dump >= MEM_T4_DUMP_INTERVAL_MS)
+    {
+        last_dump = millis();
+        MEM_T4_ReportCompact();
+    }
+#endif
+}
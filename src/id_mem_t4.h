@@ -0,0 +1,44 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_MEM_T4_H
+#define ID_MEM_T4_H
+
+#include <stddef.h>
+
+//Tracks runtime allocations in each of the Teensy memory regions so cache sizes can be tuned
+//from a report over Serial1 rather than by trial and error.
+
+typedef enum MEM_T4_Region
+{
+    MEM_T4_RAM1,   //DTCM. Static data and the stack only.
+    MEM_T4_RAM2,   //OCRAM. DMAMEM buffers and the malloc heap.
+    MEM_T4_EXTMEM, //PSRAM
+    MEM_T4_OTHER,
+    MEM_T4_NUM_REGIONS
+} MEM_T4_Region;
+
+typedef enum MEM_T4_Tag
+{
+    MEM_T4_TAG_SURFACE,  //VL_T4_CreateSurface
+    MEM_T4_TAG_MM,       //MM_GetPtr, only calls from outside id_mm.c
+    MEM_T4_TAG_USERFILE, //FS_LoadUserFile and user files held in PSRAM
+    MEM_T4_TAG_CACHE,    //File and graphics caches
+    MEM_T4_TAG_DRAW,     //Deferred draw commands
+    MEM_T4_TAG_CAPTURE,  //Frame capture buffers
+    MEM_T4_NUM_TAGS
+} MEM_T4_Tag;
+
+void MEM_T4_Startup();
+//Called while idle. Prints the compact report every MEM_T4_DUMP_INTERVAL_MS if enabled.
+void MEM_T4_Poll();
+
+MEM_T4_Region MEM_T4_RegionOf(const void *ptr);
+//Record an allocation. Tracking a pointer that is already tracked updates its size and tag.
+void MEM_T4_TrackAlloc(const void *ptr, size_t size, MEM_T4_Tag tag);
+void MEM_T4_TrackFree(const void *ptr);
+
+//Full per region and per tag breakdown, including largest free block and fragmentation.
+void MEM_T4_Report();
+//One line summary of live and peak bytes per region.
+void MEM_T4_ReportCompact();
+
+#endif
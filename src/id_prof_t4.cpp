@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <Arduino.h>
+#include "id_prof_t4.h"
+#include "id_con_t4.h"
+
+extern "C"
+{
+#include "printf.h"
+}
+
+#if PROF_T4
+#define PROF_T4_HOOK extern "C" __attribute__((no_instrument_function))
+
+typedef struct PROF_T4_Entry
+{
+    uint32_t fn; //0 if empty
+    uint32_t count;
+} PROF_T4_Entry;
+
+static PROF_T4_Entry prof_table[PROF_T4_MAX_FUNCTIONS];
+static uint32_t prof_lost; //Calls to functions that didn't fit in the table
+
+//Called on entry to every instrumented function, including from interrupts. A call racing with
+//an interrupt can be miscounted, which doesn't matter for placement.
+PROF_T4_HOOK void __cyg_profile_func_enter(void *fn, void *call_site)
+{
+    uint32_t key = (uint32_t)fn;
+    uint32_t slot = ((key >> 1) * 2654435761u) >> 16;
+    for (int probe = 0; probe < 32; probe++)
+    {
+        PROF_T4_Entry *e = &prof_table[(slot + probe) & (PROF_T4_MAX_FUNCTIONS - 1)];
+        if (e->fn == key)
+        {
+            e->count++;
+            return;
+        }
+        if (e->fn == 0)
+        {
+            e->fn = key;
+            e->count = 1;
+            return;
+        }
+    }
+    prof_lost++;
+}
+
+PROF_T4_HOOK void __cyg_profile_func_exit(void *fn, void *call_site)
+{
+}
+
+//Printing is instrumented too, so its own calls can show up in the counts
+FLASHMEM static void PROF_T4_Dump()
+{
+    int used = 0;
+    for (int i = 0; i < PROF_T4_MAX_FUNCTIONS; i++)
+    {
+        if (prof_table[i].fn)
+        {
+            printf("PROF: %08lx %lu\n", prof_table[i].fn, prof_table[i].count);
+            used++;
+        }
+    }
+    printf("PROF: end, %d functions, %lu calls not recorded\n", used, prof_lost);
+}
+
+//So a profile can cover gameplay only, rather than boot and the title screens
+FLASHMEM static void PROF_T4_Clear()
+{
+    memset(prof_table, 0, sizeof(prof_table));
+    prof_lost = 0;
+    printf("PROF: cleared\n");
+}
+#endif
+
+FLASHMEM void PROF_T4_Startup()
+{
+#if PROF_T4
+    CON_T4_Register('c', "Dump function call counts", PROF_T4_Dump);
+    CON_T4_Register('C', "Clear function call counts", PROF_T4_Clear);
+#endif
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_PROF_T4_H
+#define ID_PROF_T4_H
+
+//Per function call counts for profile guided code placement. Only active in the teensy41_profile
+//environment, which builds the game with -finstrument-functions and -DPROF_T4=1. Send 'c' on the
+//console to dump the counts, then pass the capture to tools/t4place.py.
+
+#ifndef PROF_T4
+#define PROF_T4 0
+#endif
+
+//Open addressing table of called functions, in RAM1. Must be a power of 2.
+#ifndef PROF_T4_MAX_FUNCTIONS
+#define PROF_T4_MAX_FUNCTIONS 2048
+#endif
+
+void PROF_T4_Startup();
+
+#endif
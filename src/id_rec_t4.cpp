@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <Arduino.h>
+#include <SD.h>
+#include "id_rec_t4.h"
+#include "id_con_t4.h"
+#include "id_log_t4.h"
+#include "id_sd_t4.h"
+
+extern "C"
+{
+#include "printf.h"
+#include "ck_cross.h"
+}
+
+static const int STREAM_BYTES_PER_LINE = 32;
+static const int STALL_CHECK_US = 500000;
+
+typedef struct REC_T4_Ring
+{
+    REC_T4_Header header;
+    REC_T4_Event events[REC_T4_EVENTS];
+} REC_T4_Ring;
+
+//Not cleared at startup. Each event is flushed from the data cache as it is written so nothing is
+//lost if the Teensy resets.
+static DMAMEM REC_T4_Ring ring __attribute__((aligned(32)));
+
+static struct
+{
+    bool started;
+    uint32_t frames;
+    uint32_t last_frame_us;
+    uint32_t last_frame_ms;
+
+    //Recording being streamed to Serial1
+    REC_T4_Ring *dump;
+    uint32_t dump_pos;
+} rec;
+
+static IntervalTimer stall_timer;
+
+static uint8_t REC_T4_Sum(const void *data, int len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    uint8_t sum = 0;
+    for (int i = 0; i < len; i++)
+    {
+        sum += p[i];
+    }
+    return sum;
+}
+
+static bool REC_T4_Valid(const REC_T4_Ring *r)
+{
+    return r->header.magic == REC_T4_MAGIC && r->header.version == REC_T4_VERSION &&
+           r->header.event_size == sizeof(REC_T4_Event) && r->header.num_events == REC_T4_EVENTS &&
+           r->header.head > 0;
+}
+
+//Events from the game thread and the stall timer aren't serialised. The stall timer resets the
+//Teensy straight after recording, so at worst a torn event is skipped by the decoder.
+void REC_T4_Record(REC_T4_Type type, uint16_t arg, uint32_t a, uint32_t b)
+{
+    if (!rec.started)
+    {
+        return;
+    }
+    REC_T4_Event *e = &ring.events[ring.header.head % REC_T4_EVENTS];
+    e->ms = millis();
+    e->type = type;
+    e->check = 0;
+    e->arg = arg;
+    e->a = a;
+    e->b = b;
+    e->check = 0xA5 - REC_T4_Sum(e, sizeof(*e));
+    ring.header.head++;
+    arm_dcache_flush(e, sizeof(*e));
+    arm_dcache_flush(&ring.header, sizeof(ring.header));
+}
+
+void REC_T4_Frame(uint32_t present_us, uint32_t wait_us)
+{
+    uint32_t now = micros();
+    uint32_t packed = CK_Cross_min(present_us, 0xFFFFu) | (CK_Cross_min(wait_us, 0xFFFFu) << 16);
+    REC_T4_Record(REC_T4_FRAME, SD_T4_QueueDepth(), rec.frames ? now - rec.last_frame_us : 0, packed);
+    rec.last_frame_us = now;
+    rec.last_frame_ms = millis();
+    rec.frames++;
+}
+
+//A stall in the game thread, such as the endless loop after a failed surface allocation, leaves
+//the timer interrupts running.
+static void REC_T4_StallCheck()
+{
+    uint32_t since = millis() - rec.last_frame_ms;
+    if (rec.frames == 0 || since < REC_T4_STALL_MS)
+    {
+        return;
+    }
+    REC_T4_Record(REC_T4_STALL, 0, since, rec.frames);
+    SCB_AIRCR = 0x05FA0004; //System reset
+}
+
+FLASHMEM static void REC_T4_StartStream(REC_T4_Ring *r)
+{
+    if (rec.dump != NULL && rec.dump != r)
+    {
+        free(rec.dump);
+    }
+    rec.dump = r;
+    rec.dump_pos = 0;
+}
+
+void REC_T4_Poll()
+{
+    if (rec.dump == NULL)
+    {
+        return;
+    }
+
+    //Only as much as fits in the Serial1 transmit ring, so this never waits
+    const uint8_t *bytes = (const uint8_t *)rec.dump;
+    char line[8 + STREAM_BYTES_PER_LINE * 2];
+    while (rec.dump_pos < sizeof(REC_T4_Ring) && Serial1.availableForWrite() > (int)sizeof(line))
+    {
+        int n = CK_Cross_min(STREAM_BYTES_PER_LINE, (int)(sizeof(REC_T4_Ring) - rec.dump_pos));
+        int len = sprintf(line, "REC: ");
+        for (int i = 0; i < n; i++)
+        {
+            len += sprintf(line + len, "%02x", bytes[rec.dump_pos + i]);
+        }
+        line[len++] = '\n';
+        Serial1.write((const uint8_t *)line, len);
+        rec.dump_pos += n;
+    }
+
+    if (rec.dump_pos >= sizeof(REC_T4_Ring) && Serial1.availableForWrite() > 16)
+    {
+        Serial1.write((const uint8_t *)"REC: end\n", 9);
+        free(rec.dump);
+        rec.dump = NULL;
+    }
+}
+
+//Streams a copy of the current recording
+FLASHMEM static void REC_T4_DumpCurrent()
+{
+    REC_T4_Ring *copy = (REC_T4_Ring *)malloc(sizeof(REC_T4_Ring));
+    if (copy == NULL)
+    {
+        printf("REC: Could not allocate %u bytes for the dump\n", sizeof(REC_T4_Ring));
+        return;
+    }
+    memcpy(copy, &ring, sizeof(ring));
+    printf("REC: %lu events, %lu frames since boot %lu\n", ring.header.head, rec.frames, ring.header.boot);
+    REC_T4_StartStream(copy);
+}
+
+FLASHMEM void REC_T4_Startup()
+{
+    uint32_t boot = 1;
+    if (REC_T4_Valid(&ring))
+    {
+        boot = ring.header.boot + 1;
+        //Kept until it has been saved and streamed
+        rec.dump = (REC_T4_Ring *)malloc(sizeof(REC_T4_Ring));
+        if (rec.dump != NULL)
+        {
+            memcpy(rec.dump, &ring, sizeof(ring));
+        }
+    }
+
+    memset(&ring, 0, sizeof(ring));
+    ring.header.magic = REC_T4_MAGIC;
+    ring.header.version = REC_T4_VERSION;
+    ring.header.event_size = sizeof(REC_T4_Event);
+    ring.header.num_events = REC_T4_EVENTS;
+    ring.header.boot = boot;
+    arm_dcache_flush(&ring, sizeof(ring));
+    rec.started = true;
+    REC_T4_Record(REC_T4_BOOT, 0, SRC_SRSR, boot);
+
+#if REC_T4_STALL_MS > 0
+    stall_timer.begin(REC_T4_StallCheck, STALL_CHECK_US);
+#endif
+    CON_T4_Register('r', "Stream the flight recorder to Serial1", REC_T4_DumpCurrent);
+}
+
+FLASHMEM void REC_T4_SaveDump()
+{
+    if (rec.dump == NULL)
+    {
+        return;
+    }
+
+    File f = SD.open(REC_T4_FILE, FILE_WRITE_BEGIN);
+    if (!f)
+    {
+        LOG_T4_WARN("REC: Could not create %s\n", REC_T4_FILE);
+    }
+    else
+    {
+        f.truncate();
+        f.write((const uint8_t *)rec.dump, sizeof(REC_T4_Ring));
+        f.close();
+        LOG_T4_INFO("REC: Saved recording from boot %lu, %lu events\n", rec.dump->header.boot, rec.dump->header.head);
+    }
+    REC_T4_StartStream(rec.dump);
+}
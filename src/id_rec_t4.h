@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_REC_T4_H
+#define ID_REC_T4_H
+
+#include <stdint.h>
+
+//Flight recorder for post-mortem performance data. A ring of small fixed size events is kept in
+//RAM2, which the Teensy startup code doesn't clear, so it survives a warm reset. On the next boot
+//the previous recording is written to T4REC.BIN on the SD card and streamed to Serial1 as 'REC:'
+//lines in idle time. Decode either with tools/t4rec.py.
+//
+//If no frame is presented for REC_T4_STALL_MS after the first one, a stall event is recorded and
+//the Teensy is reset so the recording can be recovered.
+
+#ifndef REC_T4_EVENTS
+#define REC_T4_EVENTS 1024 //16 bytes each
+#endif
+#ifndef REC_T4_STALL_MS
+#define REC_T4_STALL_MS 10000 //0 to disable the stall reset
+#endif
+
+#define REC_T4_MAGIC 0x43523454 //"T4RC"
+#define REC_T4_VERSION 1
+#define REC_T4_FILE "T4REC.BIN"
+
+typedef enum REC_T4_Type
+{
+    REC_T4_BOOT = 1, //a: SRC_SRSR reset reason, b: boot number
+    REC_T4_FRAME,    //arg: OPL queue depth, a: us since the last frame, b: present us | wait us << 16
+    REC_T4_ALLOC,    //arg: tag | region << 8, a: size, b: address
+    REC_T4_FREE,     //arg: tag | region << 8, a: size, b: address
+    REC_T4_FS_OPEN,  //arg: handle, a and b: first 8 characters of the name
+    REC_T4_FS_READ,  //arg: handle, a: bytes read, b: us from submit to completion
+    REC_T4_FATAL,    //arg: REC_T4_Fatal, a: detail
+    REC_T4_STALL,    //a: ms since the last frame, b: frames presented
+} REC_T4_Type;
+
+typedef enum REC_T4_Fatal
+{
+    REC_T4_FATAL_SURFACE = 1, //a: bytes that couldn't be allocated
+} REC_T4_Fatal;
+
+typedef struct REC_T4_Event
+{
+    uint32_t ms;
+    uint8_t type;
+    uint8_t check; //Makes the bytes of the event sum to 0xA5, so torn writes can be skipped
+    uint16_t arg;
+    uint32_t a;
+    uint32_t b;
+} REC_T4_Event;
+
+//The dump is this header followed by all REC_T4_EVENTS events, as they are held in RAM.
+typedef struct REC_T4_Header
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t event_size;
+    uint32_t num_events;
+    uint32_t head; //Events recorded. The next one goes in events[head % num_events].
+    uint32_t boot; //Boots since the recorder was last found empty
+    uint32_t reserved[3];
+} REC_T4_Header;
+
+//Call early in boot, before anything is recorded
+void REC_T4_Startup();
+//Boot stage once the SD card is mounted. Saves the previous recording.
+void REC_T4_SaveDump();
+//Called while idle. Streams the previous recording to Serial1.
+void REC_T4_Poll();
+
+void REC_T4_Record(REC_T4_Type type, uint16_t arg, uint32_t a, uint32_t b);
+void REC_T4_Frame(uint32_t present_us, uint32_t wait_us);
+
+#endif
@@ -1,6 +1,8 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <Arduino.h>
 #include <SPI.h>
+#include "id_sd_t4.h"
+#include "id_con_t4.h"
 
 extern "C"
 {
@@ -18,6 +20,8 @@ uint16_t ints_per_sec;
 
 static bool SD_t4_IsLocked = false;
 static bool SD_t4_AudioSubsystem_Up = false;
+static bool SD_t4_ResetDone = false;
+static uint32_t SD_t4_ResetStart;
 
 static const int OPL_PIN_RESET = 8;
 static const int OPL_PIN_A0 = 9;
@@ -26,13 +30,211 @@ static const int OPL_PIN_LATCH = 10;
 static const int OPL_PIN_DATA = 11;
 static const int OPL_PIN_SHIFT = 13;
 
+//Register writes made during a timer tick are queued as one batch and clocked out to the OPL by
+//a separate timer, rather than busy waiting between writes inside the tick. The timer fires once
+//for each latch edge, with the same delays as SD_t4_alWrite, so writes start about 128us apart.
+#ifndef SD_T4_BATCHED_OPL
+#define SD_T4_BATCHED_OPL 1
+#endif
+static const int OPL_QUEUE_SIZE = 512; //Must be a power of 2. Startup zeroes ~245 registers in one go.
+static const int OPL_ADDRESS_US = 16;   //Latch low, then high, for the register number
+static const int OPL_DATA_US = 4;       //Latch low for the value
+static const int OPL_WRITE_GAP_US = 92; //From the end of one write to the start of the next
+
 //Timing backend for the gamelogic which uses the sound system
 static IntervalTimer t0_timer;
+static IntervalTimer opl_timer;
+
+typedef struct SD_T4_OplWrite
+{
+    uint8_t reg;
+    uint8_t val;
+} SD_T4_OplWrite;
+
+static struct
+{
+    SD_T4_OplWrite queue[OPL_QUEUE_SIZE];
+    volatile uint16_t head;    //Batches up to here can be sent
+    volatile uint16_t tail;    //Next write to send
+    uint16_t pending;          //End of the batch being built
+    volatile bool in_tick;     //alOut is being called from the t0 interrupt
+    volatile bool running;     //opl_timer is clocking out writes
+    int step;
+    uint32_t due_us;  //When opl_timer next fires
+    uint32_t last_us; //When the last write finished
+
+    struct
+    {
+        uint32_t ticks;
+        uint32_t total_cycles, max_cycles; //In the t0 interrupt
+        uint32_t max_step_cycles;          //In the opl_timer interrupt
+        uint32_t writes;
+        uint32_t batches;
+        uint32_t max_batch;
+        uint32_t max_queued;
+        uint32_t full_waits; //Writes in a tick that had to wait for the tick to send others
+    } stats;
+} opl;
+
+static void SD_t4_alWrite(uint8_t reg, uint8_t val);
+
+static void SD_T4_OplStep();
+
+//Restarting the timer makes the next step run exactly us from now
+static void SD_T4_OplSchedule(uint32_t us)
+{
+    opl.due_us = micros() + us;
+    opl_timer.begin(SD_T4_OplStep, us);
+}
+
+//Sends one step of the write at the tail of the queue, and schedules the next one. The latch timings
+//match SD_t4_alWrite.
+static void SD_T4_OplStep()
+{
+    uint32_t start = ARM_DWT_CYCCNT;
+    SD_T4_OplWrite *w = &opl.queue[opl.tail];
+    switch (opl.step)
+    {
+    case 0:
+        digitalWriteFast(OPL_PIN_A0, LOW);
+        SPI.transfer(w->reg);
+        digitalWriteFast(OPL_PIN_LATCH, LOW);
+        opl.step = 1;
+        SD_T4_OplSchedule(OPL_ADDRESS_US);
+        break;
+    case 1:
+        digitalWriteFast(OPL_PIN_LATCH, HIGH);
+        opl.step = 2;
+        SD_T4_OplSchedule(OPL_ADDRESS_US);
+        break;
+    case 2:
+        digitalWriteFast(OPL_PIN_A0, HIGH);
+        SPI.transfer(w->val);
+        digitalWriteFast(OPL_PIN_LATCH, LOW);
+        opl.step = 3;
+        SD_T4_OplSchedule(OPL_DATA_US);
+        break;
+    default:
+        digitalWriteFast(OPL_PIN_LATCH, HIGH);
+        opl.last_us = micros();
+        opl.tail = (opl.tail + 1) & (OPL_QUEUE_SIZE - 1);
+        opl.step = 0;
+        opl.stats.writes++;
+        if (opl.tail == opl.head)
+        {
+            opl_timer.end();
+            opl.running = false;
+        }
+        else
+        {
+            SD_T4_OplSchedule(OPL_WRITE_GAP_US);
+        }
+        break;
+    }
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    opl.stats.max_step_cycles = CK_Cross_max(opl.stats.max_step_cycles, cycles);
+}
+
+//Makes the batch built so far visible to the output timer. Interrupts must be off or this must be
+//called from the t0 interrupt.
+static void SD_T4_OplPublish()
+{
+    uint32_t batch = (opl.pending - opl.head) & (OPL_QUEUE_SIZE - 1);
+    if (batch == 0)
+    {
+        return;
+    }
+    opl.head = opl.pending;
+    opl.stats.batches++;
+    opl.stats.max_batch = CK_Cross_max(opl.stats.max_batch, batch);
+    opl.stats.max_queued = CK_Cross_max(opl.stats.max_queued, (opl.head - opl.tail) & (OPL_QUEUE_SIZE - 1));
+    if (!opl.running)
+    {
+        //Only the part of the gap since the last write that is left has to be waited for
+        opl.running = true;
+        opl.step = 0;
+        uint32_t idle = micros() - opl.last_us;
+        if (idle >= OPL_WRITE_GAP_US)
+        {
+            SD_T4_OplStep();
+        }
+        else
+        {
+            SD_T4_OplSchedule(OPL_WRITE_GAP_US - idle);
+        }
+    }
+}
+
+static void SD_T4_OplQueue(uint8_t reg, uint8_t val)
+{
+    if (opl.in_tick)
+    {
+        uint16_t next = (opl.pending + 1) & (OPL_QUEUE_SIZE - 1);
+        if (next == opl.tail)
+        {
+            //Never drop a write, as a lost key off leaves a note playing. Every PIT channel shares one
+            //interrupt, so opl_timer can't run until the tick returns. Send the queued writes from here,
+            //at the times it would have, until there is room.
+            opl.stats.full_waits++;
+            SD_T4_OplPublish();
+            while (next == opl.tail)
+            {
+                while ((int32_t)(opl.due_us - micros()) > 0)
+                {
+                }
+                SD_T4_OplStep();
+            }
+        }
+        opl.queue[opl.pending] = {reg, val};
+        opl.pending = next;
+        return;
+    }
+
+    //From the game thread, such as startup or stopping music. Wait for room rather than dropping.
+    while (1)
+    {
+        __disable_irq();
+        uint16_t next = (opl.pending + 1) & (OPL_QUEUE_SIZE - 1);
+        if (next != opl.tail)
+        {
+            opl.queue[opl.pending] = {reg, val};
+            opl.pending = next;
+            SD_T4_OplPublish();
+            __enable_irq();
+            return;
+        }
+        __enable_irq();
+        yield();
+    }
+}
 
 //T0 service interrupts
 static void _t0service()
 {
+    uint32_t start = ARM_DWT_CYCCNT;
+    opl.in_tick = true;
     SDL_t0Service();
+    opl.in_tick = false;
+    SD_T4_OplPublish();
+
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    opl.stats.ticks++;
+    opl.stats.total_cycles += cycles;
+    opl.stats.max_cycles = CK_Cross_max(opl.stats.max_cycles, cycles);
+}
+
+int SD_T4_QueueDepth()
+{
+    return (opl.head - opl.tail) & (OPL_QUEUE_SIZE - 1);
+}
+
+FLASHMEM static void SD_T4_PrintStats()
+{
+    printf("SD: %lu ticks, %lu cycles avg, %lu max in the timer interrupt. Output step %lu cycles max\n",
+           opl.stats.ticks, opl.stats.ticks ? opl.stats.total_cycles / opl.stats.ticks : 0, opl.stats.max_cycles,
+           opl.stats.max_step_cycles);
+    printf("SD: %lu OPL writes in %lu batches, largest batch %lu, most queued %lu, %lu waited for room\n",
+           opl.stats.writes, opl.stats.batches, opl.stats.max_batch, opl.stats.max_queued, opl.stats.full_waits);
 }
 
 static void SD_t4_SetTimer0(int16_t int_8_divisor)
@@ -44,6 +246,16 @@ static void SD_t4_SetTimer0(int16_t int_8_divisor)
 }
 
 static void SD_t4_alOut(uint8_t reg, uint8_t val)
+{
+#if SD_T4_BATCHED_OPL
+    SD_T4_OplQueue(reg, val);
+#else
+    SD_t4_alWrite(reg, val);
+#endif
+}
+
+//Writes a register straight away, waiting for the previous write to settle
+static void SD_t4_alWrite(uint8_t reg, uint8_t val)
 {
     static uint32_t time_since_last = 0;
     //Ensure its been 92 microseconds since last update so we dont go too fast
@@ -69,6 +281,29 @@ static void SD_t4_PCSpkOn(bool on, int freq)
 {
 }
 
+//The OPL needs its reset line held low for a while. This is split in two so boot can do other work during it.
+void SD_T4_BeginReset()
+{
+    pinMode(OPL_PIN_LATCH, OUTPUT);
+    pinMode(OPL_PIN_A0, OUTPUT);
+    pinMode(OPL_PIN_RESET, OUTPUT);
+
+    digitalWrite(OPL_PIN_LATCH, HIGH);
+    digitalWrite(OPL_PIN_A0, LOW);
+    digitalWrite(OPL_PIN_RESET, LOW);
+    SD_t4_ResetStart = micros();
+}
+
+void SD_T4_EndReset()
+{
+    while (micros() - SD_t4_ResetStart < 1000)
+    {
+        yield();
+    }
+    digitalWrite(OPL_PIN_RESET, HIGH);
+    SD_t4_ResetDone = true;
+}
+
 static void SD_t4_Startup(void)
 {
     if (SD_t4_AudioSubsystem_Up)
@@ -82,18 +317,14 @@ static void SD_t4_Startup(void)
     //Shift should be connected to 13
     SPI.begin();
     SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE0));
+    CON_T4_Register('o', "OPL timer interrupt and register write stats", SD_T4_PrintStats);
 
-    pinMode(OPL_PIN_LATCH, OUTPUT);
-    pinMode(OPL_PIN_A0, OUTPUT);
-    pinMode(OPL_PIN_RESET, OUTPUT);
-
-    digitalWrite(OPL_PIN_LATCH, HIGH);
-    digitalWrite(OPL_PIN_RESET, HIGH);
-    digitalWrite(OPL_PIN_A0, LOW);
-
-    digitalWrite(OPL_PIN_RESET, LOW);
-    delay(1);
-    digitalWrite(OPL_PIN_RESET, HIGH);
+    //Normally already done during boot
+    if (!SD_t4_ResetDone)
+    {
+        SD_T4_BeginReset();
+        SD_T4_EndReset();
+    }
 }
 
 static void SD_t4_Shutdown(void)
@@ -0,0 +1,12 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_SD_T4_H
+#define ID_SD_T4_H
+
+//Assert the OPL reset line. SD_T4_EndReset releases it once at least 1ms has passed.
+void SD_T4_BeginReset();
+void SD_T4_EndReset();
+
+//OPL register writes waiting to be sent
+int SD_T4_QueueDepth();
+
+#endif
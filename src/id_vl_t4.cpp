@@ -1,6 +1,14 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <Arduino.h>
 #include "ILI9341Driver.h"
+#include "id_vl_t4.h"
+#include "id_con_t4.h"
+#include "id_mem_t4.h"
+#include "id_fs_t4.h"
+#include "id_log_t4.h"
+#include "id_rec_t4.h"
+#include "id_cap_t4.h"
+#include "id_vl_t4_cache.h"
 
 extern "C"
 {
@@ -17,9 +25,18 @@ typedef struct VL_T4_Surface
 {
     VL_SurfaceUsage use;
     int width, height;
+    bool packed; //4 bits per pixel instead of 8
+    int pitch;   //Bytes per row
     uint8_t *pixels;
 } VL_T4_Surface;
 
+//Surfaces can optionally be stored as packed 4 bit pixels, two per byte with the left pixel in the low
+//nibble. Only 16 colours are ever used, so this halves surface memory and the data present has to read.
+#ifndef VL_T4_PACKED_SURFACES
+#define VL_T4_PACKED_SURFACES 0
+#endif
+#define VL_T4_PITCH(w) (VL_T4_PACKED_SURFACES ? ((w) + 1) / 2 : (w))
+
 #define TFT_ROTATION 1 //0-3
 #define TFT_DC 38
 #define TFT_CS 40
@@ -27,42 +44,735 @@ typedef struct VL_T4_Surface
 #define TFT_SCK 27
 #define TFT_MISO 39
 #define TFT_RST 41
+#ifndef TFT_SPI_SPEED
+#define TFT_SPI_SPEED 60000000 //Lower this for long display cables
+#endif
 ILI9341_T4::ILI9341Driver tft(TFT_CS, TFT_DC, TFT_SCK, TFT_MOSI, TFT_MISO, TFT_RST);
-DMAMEM uint16_t tft_buffer[240*320]; //RGB565 TFT buffer
-DMAMEM uint16_t fb_internal[240*320]; //RGB565 TFT backbuffer
+DMAMEM uint16_t tft_buffer[240*320]; //RGB565 TFT buffer. The game converts into this one.
+DMAMEM uint16_t fb_internal[240*320]; //RGB565 TFT backbuffer. The driver DMAs from this one.
 ILI9341_T4::DiffBuffStatic<4096> diff1; //Manage diff between buffers
 
 //All games memory is malloced into RAM2 or external RAM.
 //However the front buffer we create statically in RAM1 for the best performance.
 static bool front_buffer_in_use = false;
-static uint8_t front_buffer[336 * 224];
+static uint8_t front_buffer[VL_T4_PITCH(336) * 224];
 
 //Game buffers are 8 bit indexed values with 16 colours. A palette is used to convert to RGB565.
 static uint16_t palette[16];
+static uint32_t palette_pair[256]; //Two RGB565 pixels for each byte of a packed surface
 
-static void VL_T4_SetVideoMode(int mode)
+static inline int VL_T4_GetPixel(VL_T4_Surface *surf, int x, int y)
 {
-    if (mode == 0xD)
+    if (surf->packed)
+    {
+        return (surf->pixels[y * surf->pitch + (x >> 1)] >> ((x & 1) << 2)) & 0xF;
+    }
+    return surf->pixels[y * surf->pitch + x];
+}
+
+static inline void VL_T4_SetPixel(VL_T4_Surface *surf, int x, int y, int colour)
+{
+    if (surf->packed)
+    {
+        uint8_t *p = &surf->pixels[y * surf->pitch + (x >> 1)];
+        int shift = (x & 1) << 2;
+        *p = (*p & ~(0xF << shift)) | ((colour & 0xF) << shift);
+        return;
+    }
+    surf->pixels[y * surf->pitch + x] = colour;
+}
+
+//Apply p = (p & and_mask) ^ xor_val to a horizontal run of pixels.
+static void VL_T4_ApplySpan(VL_T4_Surface *surf, int x, int y, int w, uint8_t and_mask, uint8_t xor_val)
+{
+    uint8_t *row = &surf->pixels[y * surf->pitch];
+    int end = x + w;
+    if (!surf->packed)
+    {
+        if (and_mask == 0)
+        {
+            memset(row + x, xor_val, w);
+            return;
+        }
+        for (; x < end; x++)
+        {
+            row[x] = (row[x] & and_mask) ^ xor_val;
+        }
+        return;
+    }
+
+    if (x < end && (x & 1))
+    {
+        VL_T4_SetPixel(surf, x, y, (VL_T4_GetPixel(surf, x, y) & and_mask) ^ xor_val);
+        x++;
+    }
+    uint8_t and_pair = (and_mask & 0xF) | (and_mask << 4);
+    uint8_t xor_pair = (xor_val & 0xF) | (xor_val << 4);
+    if (and_pair == 0)
+    {
+        memset(row + (x >> 1), xor_pair, (end - x) >> 1);
+        x += (end - x) & ~1;
+    }
+    for (; x + 1 < end; x += 2)
+    {
+        row[x >> 1] = (row[x >> 1] & and_pair) ^ xor_pair;
+    }
+    if (x < end)
+    {
+        VL_T4_SetPixel(surf, x, y, (VL_T4_GetPixel(surf, x, y) & and_mask) ^ xor_val);
+    }
+}
+
+//The packed byte holding pixels x and x + 1 of a row that starts on an odd pixel, where row points at the byte
+//holding that first pixel. Pixel pairs then straddle two bytes, so they are realigned a pair at a time.
+static inline uint8_t VL_T4_ShiftedPair(const uint8_t *row, int i)
+{
+    return (row[i] >> 4) | (row[i + 1] << 4);
+}
+
+//Copy w pixels of a row into out as one byte per pixel.
+static void VL_T4_ReadRow(VL_T4_Surface *surf, int x, int y, int w, uint8_t *out)
+{
+    if (!surf->packed)
+    {
+        memcpy(out, &surf->pixels[y * surf->pitch + x], w);
+        return;
+    }
+    for (int i = 0; i < w; i++)
+    {
+        out[i] = VL_T4_GetPixel(surf, x + i, y);
+    }
+}
+
+static void VL_T4_WriteRow(VL_T4_Surface *surf, int x, int y, int w, const uint8_t *in)
+{
+    if (!surf->packed)
+    {
+        memcpy(&surf->pixels[y * surf->pitch + x], in, w);
+        return;
+    }
+    for (int i = 0; i < w; i++)
+    {
+        VL_T4_SetPixel(surf, x + i, y, in[i]);
+    }
+}
+
+//Copy part of a row between surfaces of either format. Overlapping copies within a surface are handled.
+static void VL_T4_CopyRow(VL_T4_Surface *dst, int x, int y, VL_T4_Surface *src, int sx, int sy, int w)
+{
+    if (w <= 0)
+    {
+        return;
+    }
+    if (!dst->packed && !src->packed)
+    {
+        memmove(&dst->pixels[y * dst->pitch + x], &src->pixels[sy * src->pitch + sx], w);
+        return;
+    }
+    if (dst->packed && src->packed && !(x & 1) && !(sx & 1))
+    {
+        //Both start on a byte boundary, so whole bytes can be moved
+        int last = VL_T4_GetPixel(src, sx + w - 1, sy);
+        memmove(&dst->pixels[y * dst->pitch + (x >> 1)], &src->pixels[sy * src->pitch + (sx >> 1)], w >> 1);
+        if (w & 1)
+        {
+            VL_T4_SetPixel(dst, x + w - 1, y, last);
+        }
+        return;
+    }
+
+    //Go through a line buffer in chunks, from the right if the copy overlaps to the right.
+    uint8_t line[256];
+    bool backwards = (dst == src && y == sy && x > sx);
+    for (int done = 0; done < w; done += sizeof(line))
+    {
+        int n = CK_Cross_min((int)sizeof(line), w - done);
+        int offset = backwards ? w - done - n : done;
+        VL_T4_ReadRow(src, sx + offset, sy, n, line);
+        VL_T4_WriteRow(dst, x + offset, y, n, line);
+    }
+}
+
+//Deferred drawing. When enabled, draws are recorded into a per-frame arena instead of being applied straight away.
+//On flush the commands are bucketed by destination band, and each band is rasterised in a small buffer in RAM1
+//before being merged back, so a surface in RAM2 or PSRAM is only read and written once per band. Draws that a
+//later opaque draw completely covers within a band are culled.
+#ifndef VL_T4_DEFERRED_DRAW
+#define VL_T4_DEFERRED_DRAW 0
+#endif
+#ifndef VL_T4_DEFER_ARENA
+#define VL_T4_DEFER_ARENA (32 * 1024) //Bytes of recorded graphics before an early flush
+#endif
+#define VL_T4_DEFER_MAX_CMDS 512
+#define VL_T4_DEFER_MAX_REFS 2048 //Command and band pairs
+#define VL_T4_DEFER_BAND 16
+#define VL_T4_DEFER_MAX_WIDTH 336
+#define VL_T4_DEFER_MAX_BANDS ((224 + VL_T4_DEFER_BAND - 1) / VL_T4_DEFER_BAND)
+
+typedef struct VL_T4_DrawCmd
+{
+    VL_T4_Surface *surf;   //NULL once flushed
+    int x, y, w, h;        //Already clipped to the surface
+    uint8_t *colour;       //w * h bytes in the arena, NULL for a fill
+    uint8_t *mask;         //w * h bytes in the arena, NULL if opaque
+    uint8_t and_mask;      //Fills only
+    uint8_t xor_val;
+} VL_T4_DrawCmd;
+
+typedef struct VL_T4_DeferStats
+{
+    uint32_t cmds, flushes, early_flushes;
+    uint32_t culled, pixels_culled;
+    uint32_t pixels_drawn, pixels_merged;
+    uint32_t total_cycles, max_cycles;
+    uint32_t arena_peak;
+} VL_T4_DeferStats;
+
+static struct
+{
+    bool enabled;
+    VL_T4_DrawCmd *cmds;
+    uint16_t *refs;
+    uint8_t *arena;
+    int num_cmds, num_refs, arena_used;
+    VL_T4_DeferStats stats;
+} defer;
+static uint8_t defer_band[VL_T4_DEFER_BAND * VL_T4_DEFER_MAX_WIDTH];
+
+static bool VL_T4_DeferEligible(VL_T4_Surface *surf)
+{
+    return defer.enabled && surf->width <= VL_T4_DEFER_MAX_WIDTH &&
+           surf->height <= VL_T4_DEFER_MAX_BANDS * VL_T4_DEFER_BAND;
+}
+
+//True if a later opaque command covers all of cmd between rows y0 and y1.
+static bool VL_T4_DeferHidden(const VL_T4_DrawCmd *cmd, int y0, int y1, const uint16_t *later, int n)
+{
+    for (int i = 0; i < n; i++)
     {
-        tft.output(&Serial1);
-        while (!tft.begin(60000000, 6000000))
+        const VL_T4_DrawCmd *o = &defer.cmds[later[i]];
+        bool opaque = o->colour ? (o->mask == NULL) : (o->and_mask == 0);
+        if (opaque && o->x <= cmd->x && o->x + o->w >= cmd->x + cmd->w && o->y <= y0 && o->y + o->h >= y1)
         {
-            delay(1000); yield();
+            return true;
         }
-        tft.setRotation(TFT_ROTATION);
-        tft.setFramebuffers(fb_internal);
-        tft.setDiffBuffers(&diff1); 
-        tft.setRefreshRate(70);
-        tft.setVSyncSpacing(2);
+    }
+    return false;
+}
+
+static void VL_T4_DeferRasterBand(VL_T4_Surface *surf, int band, const uint16_t *refs, int n)
+{
+    int band_y = band * VL_T4_DEFER_BAND;
+    int band_end = band_y + VL_T4_DEFER_BAND;
+    int x0 = surf->width, x1 = 0, y0 = band_end, y1 = band_y;
+    for (int i = 0; i < n; i++)
+    {
+        const VL_T4_DrawCmd *cmd = &defer.cmds[refs[i]];
+        x0 = CK_Cross_min(x0, cmd->x);
+        x1 = CK_Cross_max(x1, cmd->x + cmd->w);
+        y0 = CK_Cross_min(y0, CK_Cross_max(cmd->y, band_y));
+        y1 = CK_Cross_max(y1, CK_Cross_min(cmd->y + cmd->h, band_end));
+    }
+    for (int y = y0; y < y1; y++)
+    {
+        VL_T4_ReadRow(surf, x0, y, x1 - x0, &defer_band[(y - band_y) * VL_T4_DEFER_MAX_WIDTH + x0]);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        const VL_T4_DrawCmd *cmd = &defer.cmds[refs[i]];
+        int cy0 = CK_Cross_max(cmd->y, band_y);
+        int cy1 = CK_Cross_min(cmd->y + cmd->h, band_end);
+        uint32_t pixels = cmd->w * (cy1 - cy0);
+        if (VL_T4_DeferHidden(cmd, cy0, cy1, refs + i + 1, n - i - 1))
+        {
+            defer.stats.culled++;
+            defer.stats.pixels_culled += pixels;
+            continue;
+        }
+        defer.stats.pixels_drawn += pixels;
+
+        for (int y = cy0; y < cy1; y++)
+        {
+            uint8_t *dst = &defer_band[(y - band_y) * VL_T4_DEFER_MAX_WIDTH + cmd->x];
+            if (cmd->colour == NULL)
+            {
+                for (int x = 0; x < cmd->w; x++)
+                {
+                    dst[x] = (dst[x] & cmd->and_mask) ^ cmd->xor_val;
+                }
+                continue;
+            }
+            const uint8_t *colour = &cmd->colour[(y - cmd->y) * cmd->w];
+            if (cmd->mask == NULL)
+            {
+                memcpy(dst, colour, cmd->w);
+                continue;
+            }
+            const uint8_t *mask = &cmd->mask[(y - cmd->y) * cmd->w];
+            for (int x = 0; x < cmd->w; x++)
+            {
+                dst[x] = (dst[x] & mask[x]) ^ colour[x];
+            }
+        }
+    }
+
+    for (int y = y0; y < y1; y++)
+    {
+        VL_T4_WriteRow(surf, x0, y, x1 - x0, &defer_band[(y - band_y) * VL_T4_DEFER_MAX_WIDTH + x0]);
+    }
+    defer.stats.pixels_merged += (x1 - x0) * (y1 - y0);
+}
+
+static void VL_T4_DeferFlushSurface(VL_T4_Surface *surf, int first)
+{
+    //Bucket the commands by band, keeping them in the order they were issued within each band
+    int start[VL_T4_DEFER_MAX_BANDS + 1] = {0};
+    int fill[VL_T4_DEFER_MAX_BANDS];
+    for (int i = first; i < defer.num_cmds; i++)
+    {
+        const VL_T4_DrawCmd *cmd = &defer.cmds[i];
+        if (cmd->surf != surf)
+        {
+            continue;
+        }
+        for (int b = cmd->y / VL_T4_DEFER_BAND; b <= (cmd->y + cmd->h - 1) / VL_T4_DEFER_BAND; b++)
+        {
+            start[b + 1]++;
+        }
+    }
+    for (int b = 0; b < VL_T4_DEFER_MAX_BANDS; b++)
+    {
+        start[b + 1] += start[b];
+        fill[b] = start[b];
+    }
+    for (int i = first; i < defer.num_cmds; i++)
+    {
+        VL_T4_DrawCmd *cmd = &defer.cmds[i];
+        if (cmd->surf != surf)
+        {
+            continue;
+        }
+        for (int b = cmd->y / VL_T4_DEFER_BAND; b <= (cmd->y + cmd->h - 1) / VL_T4_DEFER_BAND; b++)
+        {
+            defer.refs[fill[b]++] = i;
+        }
+        cmd->surf = NULL;
+    }
+
+    for (int b = 0; b < VL_T4_DEFER_MAX_BANDS; b++)
+    {
+        if (start[b + 1] > start[b])
+        {
+            VL_T4_DeferRasterBand(surf, b, &defer.refs[start[b]], start[b + 1] - start[b]);
+        }
+    }
+}
+
+//Apply every recorded draw. Anything that reads a surface, or draws outside of the command list, must flush first.
+static void VL_T4_DeferFlush()
+{
+    if (defer.num_cmds == 0)
+    {
+        return;
+    }
+
+    uint32_t start = ARM_DWT_CYCCNT;
+    //Draws to different surfaces are independent, so each surface is flushed in turn
+    for (int i = 0; i < defer.num_cmds; i++)
+    {
+        if (defer.cmds[i].surf != NULL)
+        {
+            VL_T4_DeferFlushSurface(defer.cmds[i].surf, i);
+        }
+    }
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+
+    defer.stats.arena_peak = CK_Cross_max(defer.stats.arena_peak, (uint32_t)defer.arena_used);
+    defer.stats.flushes++;
+    defer.stats.total_cycles += cycles;
+    defer.stats.max_cycles = CK_Cross_max(defer.stats.max_cycles, cycles);
+    defer.num_cmds = 0;
+    defer.num_refs = 0;
+    defer.arena_used = 0;
+}
+
+//Add a command for a w x h draw with planes bytes of data per pixel. Returns NULL if the draw should be applied
+//directly instead, and sets clip_x and clip_y to where the clipped draw starts within the original.
+static VL_T4_DrawCmd *VL_T4_DeferRecord(VL_T4_Surface *surf, int x, int y, int w, int h, int planes, int *clip_x, int *clip_y)
+{
+    if (!VL_T4_DeferEligible(surf))
+    {
+        return NULL;
+    }
+    int x0 = CK_Cross_max(x, 0), x1 = CK_Cross_min(x + w, surf->width);
+    int y0 = CK_Cross_max(y, 0), y1 = CK_Cross_min(y + h, surf->height);
+    int bytes = (x1 - x0) * (y1 - y0) * planes;
+    if (x0 >= x1 || y0 >= y1 || bytes > VL_T4_DEFER_ARENA)
+    {
+        //Keep the draw order intact for the direct draw
+        VL_T4_DeferFlush();
+        return NULL;
+    }
+
+    int bands = (y1 - 1) / VL_T4_DEFER_BAND - y0 / VL_T4_DEFER_BAND + 1;
+    if (defer.num_cmds == VL_T4_DEFER_MAX_CMDS || defer.num_refs + bands > VL_T4_DEFER_MAX_REFS ||
+        defer.arena_used + bytes > VL_T4_DEFER_ARENA)
+    {
+        defer.stats.early_flushes++;
+        VL_T4_DeferFlush();
+    }
+
+    VL_T4_DrawCmd *cmd = &defer.cmds[defer.num_cmds++];
+    cmd->surf = surf;
+    cmd->x = x0;
+    cmd->y = y0;
+    cmd->w = x1 - x0;
+    cmd->h = y1 - y0;
+    cmd->colour = (planes > 0) ? &defer.arena[defer.arena_used] : NULL;
+    cmd->mask = (planes > 1) ? &defer.arena[defer.arena_used + cmd->w * cmd->h] : NULL;
+    defer.num_refs += bands;
+    defer.arena_used += bytes;
+    defer.stats.cmds++;
+    *clip_x = x0 - x;
+    *clip_y = y0 - y;
+    return cmd;
+}
+
+static bool VL_T4_DeferFill(VL_T4_Surface *surf, int x, int y, int w, int h, uint8_t and_mask, uint8_t xor_val)
+{
+    int clip_x, clip_y;
+    VL_T4_DrawCmd *cmd = VL_T4_DeferRecord(surf, x, y, w, h, 0, &clip_x, &clip_y);
+    if (cmd == NULL)
+    {
+        return false;
+    }
+    cmd->and_mask = and_mask;
+    cmd->xor_val = xor_val;
+    return true;
+}
+
+static bool VL_T4_DeferGfx(VL_T4_Surface *surf, const VL_T4_Expanded *gfx, int x, int y)
+{
+    int clip_x, clip_y;
+    VL_T4_DrawCmd *cmd = VL_T4_DeferRecord(surf, x, y, gfx->w, gfx->h, gfx->mask ? 2 : 1, &clip_x, &clip_y);
+    if (cmd == NULL)
+    {
+        return false;
+    }
+    for (int _y = 0; _y < cmd->h; _y++)
+    {
+        int offset = (clip_y + _y) * gfx->w + clip_x;
+        memcpy(&cmd->colour[_y * cmd->w], &gfx->colour[offset], cmd->w);
+        if (gfx->mask)
+        {
+            memcpy(&cmd->mask[_y * cmd->w], &gfx->mask[offset], cmd->w);
+        }
+    }
+    return true;
+}
+
+FLASHMEM static void VL_T4_DeferEnable(bool enable)
+{
+    VL_T4_DeferFlush();
+    if (enable && defer.cmds == NULL)
+    {
+        size_t bytes = sizeof(VL_T4_DrawCmd) * VL_T4_DEFER_MAX_CMDS + sizeof(uint16_t) * VL_T4_DEFER_MAX_REFS + VL_T4_DEFER_ARENA;
+        uint8_t *p = (uint8_t *)malloc(bytes);
+        if (p == NULL)
+        {
+            LOG_T4_WARN("VL: Could not allocate %u bytes for deferred drawing\n", bytes);
+            return;
+        }
+        MEM_T4_TrackAlloc(p, bytes, MEM_T4_TAG_DRAW);
+        defer.cmds = (VL_T4_DrawCmd *)p;
+        defer.refs = (uint16_t *)(defer.cmds + VL_T4_DEFER_MAX_CMDS);
+        defer.arena = (uint8_t *)(defer.refs + VL_T4_DEFER_MAX_REFS);
+    }
+    defer.enabled = enable;
+}
+
+FLASHMEM static void VL_T4_DeferToggle()
+{
+    VL_T4_DeferEnable(!defer.enabled);
+    printf("VL: deferred drawing %s\n", defer.enabled ? "on" : "off");
+}
+
+//Optional smooth vertical scaling. Rather than duplicating every 5th row, each output row
+//is blended from the two nearest source rows. 200 rows map to 240, so every output row sits
+//on a 1/6th boundary between two source rows. With only 16 colours, every possible blend for
+//each of the 5 non-zero weights is precomputed into a table whenever the palette changes.
+//VL_T4_SMOOTH_SCALE picks the path at boot, and 's' on the console switches between them, so 'v'
+//can report both from the same build.
+#ifndef VL_T4_SMOOTH_SCALE
+#define VL_T4_SMOOTH_SCALE 0
+#endif
+static bool smooth_scale = VL_T4_SMOOTH_SCALE;
+static uint16_t palette_blend[5][256]; //[weight - 1][(top << 4) | bottom]
+static uint8_t scale_row_offset[240];  //Source row offset for each output row
+static uint8_t scale_row_weight[240];  //Weight of the lower source row in 1/6ths
+
+FLASHMEM static void VL_T4_SmoothToggle()
+{
+    smooth_scale = !smooth_scale;
+    printf("VL: %s scaling\n", smooth_scale ? "smooth" : "nearest");
+}
+
+//Present timing in CPU cycles, kept for both scaling paths so they can be compared.
+typedef struct VL_T4_PresentStats
+{
+    uint32_t frames;
+    uint32_t total_cycles;
+    uint32_t max_cycles;
+} VL_T4_PresentStats;
+static VL_T4_PresentStats present_stats[2]; //0 = nearest neighbour, 1 = smooth
+//Presenting is pipelined across the two buffers above. tft.update() waits for the previous DMA to finish
+//before copying tft_buffer into fb_internal, so rather than calling it straight after converting, the
+//handoff is deferred until the driver is idle. It is attempted at the end of present and while
+//idling in VL_T4_WaitVBLs, so the game only blocks if it wants to convert the next frame while
+//tft_buffer still holds one the driver hasn't taken yet. Blocking work such as a level load calls
+//VL_T4_PresentFlush first, so the last frame presented is on screen while the game waits.
+static bool present_pending = false;
+typedef struct VL_T4_PipelineStats
+{
+    uint32_t handoffs_idle;     //Frames handed off without waiting
+    uint32_t handoffs_blocking; //Frames the game had to wait on the driver for
+    uint32_t wait_us_total;
+    uint32_t wait_us_max;
+    uint32_t update_us_total;   //Time spent inside tft.update() (copy and diff)
+} VL_T4_PipelineStats;
+static VL_T4_PipelineStats pipeline_stats;
+//Graphics that needed expanding when there was no memory for it. PAL8 surfaces are drawn with the direct
+//routine instead. The PAL8 routines can't write packed surfaces, so those draws are lost.
+static struct
+{
+    uint32_t direct;
+    uint32_t dropped;
+} gfx_fallback;
+static void VL_T4_PrintStats();
+
+#ifndef VL_T4_STATS_INTERVAL
+#define VL_T4_STATS_INTERVAL 0 //Frames between printing stats, 350 would be every 10 seconds at 35fps. 0 to disable.
+#endif
+
+//Copy-on-write surface snapshots. When a whole surface is copied to another of the same size (such as
+//the control panel saving the game screen) the copy just records that every tile is shared with the
+//source. Before either surface is written, or the snapshot is read, the affected tiles are copied
+//across. Restoring the snapshot back onto its source then only copies the tiles that changed, and ends the
+//share so the game's writes to the source don't keep paying for tile checks and copies after the menu closes.
+#define VL_T4_COW_TILE 16
+#define VL_T4_COW_MAX_TILES (((336 + VL_T4_COW_TILE - 1) / VL_T4_COW_TILE) * ((224 + VL_T4_COW_TILE - 1) / VL_T4_COW_TILE))
+static struct
+{
+    VL_T4_Surface *src;  //Always holds its own pixels
+    VL_T4_Surface *snap; //Tiles flagged as shared are only valid in src
+    int tiles_x, tiles_y;
+    uint8_t shared[VL_T4_COW_MAX_TILES];
+} cow;
+
+static void VL_T4_CowCopyTile(VL_T4_Surface *from, VL_T4_Surface *to, int tx, int ty)
+{
+    int x = tx * VL_T4_COW_TILE;
+    int y = ty * VL_T4_COW_TILE;
+    int w = CK_Cross_min(VL_T4_COW_TILE, from->width - x);
+    int h = CK_Cross_min(VL_T4_COW_TILE, from->height - y);
+    int offset = from->packed ? x / 2 : x;
+    int bytes = from->packed ? (w + 1) / 2 : w;
+    for (int _y = y; _y < y + h; _y++)
+    {
+        memcpy(&to->pixels[_y * to->pitch + offset], &from->pixels[_y * from->pitch + offset], bytes);
+    }
+}
+
+//Must be called before writing to any surface.
+static void VL_T4_CowUnshare(VL_T4_Surface *surf, int x, int y, int w, int h)
+{
+    if (cow.src == NULL || (surf != cow.src && surf != cow.snap) || w <= 0 || h <= 0)
+    {
+        return;
+    }
+
+    int tx0 = CK_Cross_max(x, 0) / VL_T4_COW_TILE;
+    int ty0 = CK_Cross_max(y, 0) / VL_T4_COW_TILE;
+    int tx1 = CK_Cross_min((x + w - 1) / VL_T4_COW_TILE, cow.tiles_x - 1);
+    int ty1 = CK_Cross_min((y + h - 1) / VL_T4_COW_TILE, cow.tiles_y - 1);
+    for (int ty = ty0; ty <= ty1; ty++)
+    {
+        for (int tx = tx0; tx <= tx1; tx++)
+        {
+            uint8_t *shared = &cow.shared[ty * cow.tiles_x + tx];
+            if (*shared)
+            {
+                VL_T4_CowCopyTile(cow.src, cow.snap, tx, ty);
+                *shared = 0;
+            }
+        }
+    }
+}
+
+static void VL_T4_CowRead(VL_T4_Surface *surf, int x, int y, int w, int h)
+{
+    if (surf == cow.snap)
+    {
+        VL_T4_CowUnshare(surf, x, y, w, h);
+    }
+}
+
+//Forget the snapshot without copying anything, for when the snapshot's pixels are no longer needed
+static void VL_T4_CowDrop()
+{
+    cow.src = NULL;
+    cow.snap = NULL;
+    memset(cow.shared, 0, sizeof(cow.shared));
+}
+
+//End the share, first giving the snapshot its own copy of every shared tile
+static void VL_T4_CowRelease()
+{
+    if (cow.src != NULL)
+    {
+        VL_T4_CowUnshare(cow.snap, 0, 0, cow.snap->width, cow.snap->height);
+    }
+    VL_T4_CowDrop();
+}
+
+//Make snap a copy of src. Returns immediately, pixels are only copied as tiles are modified.
+void VL_T4_SnapshotSurface(void *src_surface, void *snap_surface)
+{
+    VL_T4_Surface *src = (VL_T4_Surface *)src_surface;
+    VL_T4_Surface *snap = (VL_T4_Surface *)snap_surface;
+    VL_T4_DeferFlush();
+    int tiles_x = (src->width + VL_T4_COW_TILE - 1) / VL_T4_COW_TILE;
+    int tiles_y = (src->height + VL_T4_COW_TILE - 1) / VL_T4_COW_TILE;
+    if (src == snap)
+    {
+        return;
+    }
+
+    //Only one snapshot is tracked at a time. snap is about to be overwritten so it doesn't need its tiles back.
+    if (cow.snap == snap)
+    {
+        VL_T4_CowDrop();
+    }
+    VL_T4_CowRelease();
+
+    if (src->width != snap->width || src->height != snap->height || src->packed != snap->packed ||
+        tiles_x * tiles_y > VL_T4_COW_MAX_TILES)
+    {
+        for (int _y = 0; _y < src->height; _y++)
+        {
+            VL_T4_CopyRow(snap, 0, _y, src, 0, _y, src->width);
+        }
+        return;
+    }
+
+    cow.src = src;
+    cow.snap = snap;
+    cow.tiles_x = tiles_x;
+    cow.tiles_y = tiles_y;
+    memset(cow.shared, 1, tiles_x * tiles_y);
+}
+
+//Copy snap back onto dst. If snap is a snapshot of dst, only the tiles changed since it was taken are copied.
+void VL_T4_RestoreSnapshot(void *snap_surface, void *dst_surface)
+{
+    VL_T4_Surface *snap = (VL_T4_Surface *)snap_surface;
+    VL_T4_Surface *dst = (VL_T4_Surface *)dst_surface;
+    VL_T4_DeferFlush();
+    if (cow.snap != snap || cow.src != dst)
+    {
+        VL_T4_SnapshotSurface(snap, dst);
+        return;
+    }
+
+    for (int ty = 0; ty < cow.tiles_y; ty++)
+    {
+        for (int tx = 0; tx < cow.tiles_x; tx++)
+        {
+            uint8_t *shared = &cow.shared[ty * cow.tiles_x + tx];
+            if (!*shared)
+            {
+                VL_T4_CowCopyTile(snap, dst, tx, ty);
+            }
+        }
+    }
+    //Both surfaces now hold the same image. The snapshot still has to stay valid, so its remaining tiles are
+    //copied in one pass here rather than one at a time as the game draws over the source.
+    VL_T4_CowRelease();
+}
+
+static inline uint16_t VL_T4_RGB565(int r, int g, int b)
+{
+    return ((r >> 3) << 11) | ((g >> 2) << 5) | ((b >> 3) << 0); //rgb 565 for the TFT
+}
+
+static bool tft_ready = false;
+
+void VL_T4_Startup()
+{
+    if (tft_ready)
+    {
+        return;
+    }
+
+    tft.output(&Serial1);
+    while (!tft.begin(TFT_SPI_SPEED, 6000000))
+    {
+        delay(100); yield();
+    }
+    tft.setRotation(TFT_ROTATION);
+    tft.setFramebuffers(fb_internal);
+    tft.setDiffBuffers(&diff1); 
+    tft.setRefreshRate(70);
+    tft.setVSyncSpacing(2);
+    CON_T4_Register('v', "Video present timings", VL_T4_PrintStats);
+    CON_T4_Register('d', "Toggle deferred drawing", VL_T4_DeferToggle);
+    CON_T4_Register('s', "Toggle smooth scaling", VL_T4_SmoothToggle);
+    VL_T4_DeferEnable(VL_T4_DEFERRED_DRAW);
+    VL_T4_GfxCacheStartup();
+
+    //Precompute the 200 to 240 row mapping for smooth scaling. Each group of 6 output rows covers 5 source rows.
+    for (int y = 0; y < 240; y++)
+    {
+        scale_row_offset[y] = (y * 5) / 6;
+        scale_row_weight[y] = (y * 5) % 6;
+    }
+    tft_ready = true;
+}
+
+void VL_T4_ShowSplash()
+{
+    //Plain screen with a bar across the middle. The update is asynchronous, so the
+    //rest of boot continues while it is sent to the display.
+    const uint16_t background = VL_T4_RGB565(0x00, 0x00, 0xAA);
+    const uint16_t bar = VL_T4_RGB565(0x55, 0xFF, 0xFF);
+    for (int i = 0; i < 240 * 320; i++)
+    {
+        tft_buffer[i] = background;
+    }
+    for (int y = 116; y < 124; y++)
+    {
+        for (int x = 80; x < 240; x++)
+        {
+            tft_buffer[y * 320 + x] = bar;
+        }
+    }
+    tft.update(tft_buffer);
+}
+
+static void VL_T4_SetVideoMode(int mode)
+{
+    if (mode == 0xD)
+    {
+        VL_T4_Startup();
     }
     else
     {
     }
 }
 
-static void VL_T4_Present(void *surface, int scrlX, int scrlY, bool singleBuffered)
+static void VL_T4_PresentNearest(VL_T4_Surface *src, int scrlX, int scrlY)
 {
-    VL_T4_Surface *src = (VL_T4_Surface *)surface;
     uint16_t *dest = tft_buffer;
     int y_dest = 0, x_dest = 0;
     for (int _y = scrlY; _y < src->height; _y++)
@@ -72,7 +782,7 @@ static void VL_T4_Present(void *surface, int scrlX, int scrlY, bool singleBuffer
             break;
         }
 
-        uint8_t *src_row = &src->pixels[_y * src->width];
+        uint8_t *src_row = &src->pixels[_y * src->pitch];
         x_dest = 0;
         for (int _x = scrlX; _x < src->width; _x++)
         {
@@ -102,15 +812,278 @@ static void VL_T4_Present(void *surface, int scrlX, int scrlY, bool singleBuffer
         }
         y_dest++;
     }
+}
+
+//Packed surfaces convert a byte at a time, straight to two RGB565 pixels.
+static void VL_T4_PresentNearestPacked(VL_T4_Surface *src, int scrlX, int scrlY)
+{
+    int width = CK_Cross_min(320, src->width - scrlX);
+    int y_dest = 0;
+    for (int _y = scrlY; _y < src->height && y_dest < 240; _y++)
+    {
+        uint16_t *dest_row = &tft_buffer[y_dest * 320];
+        const uint8_t *src_row = &src->pixels[_y * src->pitch + (scrlX >> 1)];
+        uint32_t *dest_pair = (uint32_t *)dest_row;
+        if (scrlX & 1)
+        {
+            for (int i = 0; i < width / 2; i++)
+            {
+                dest_pair[i] = palette_pair[VL_T4_ShiftedPair(src_row, i)];
+            }
+            if (width & 1)
+            {
+                dest_row[width - 1] = palette[src_row[width / 2] >> 4];
+            }
+        }
+        else
+        {
+            for (int i = 0; i < width / 2; i++)
+            {
+                dest_pair[i] = palette_pair[src_row[i]];
+            }
+            if (width & 1)
+            {
+                dest_row[width - 1] = palette[src_row[width / 2] & 0xF];
+            }
+        }
+
+        //Every 5th row is doubled, same as the 8 bit path
+        if (_y % 5 == 0 && y_dest + 1 < 240)
+        {
+            memcpy(dest_row + 320, dest_row, width * sizeof(uint16_t));
+            y_dest++;
+        }
+        y_dest++;
+    }
+}
+
+static void VL_T4_PresentSmooth(VL_T4_Surface *src, int scrlX, int scrlY)
+{
+    static uint8_t line[2][320];
+    int width = CK_Cross_min(320, src->width - scrlX);
+    for (int y_dest = 0; y_dest < 240; y_dest++)
+    {
+        int _y = scrlY + scale_row_offset[y_dest];
+        if (_y >= src->height)
+        {
+            break;
+        }
+
+        uint16_t *dest_row = &tft_buffer[y_dest * 320];
+        uint8_t *top = &src->pixels[_y * src->pitch + scrlX];
+        if (src->packed)
+        {
+            VL_T4_ReadRow(src, scrlX, _y, width, line[0]);
+            top = line[0];
+        }
+        int weight = scale_row_weight[y_dest];
+        if (weight == 0 || _y + 1 >= src->height)
+        {
+            //Output row lines up with a source row exactly
+            for (int _x = 0; _x < width; _x++)
+            {
+                dest_row[_x] = palette[top[_x]];
+            }
+            continue;
+        }
+
+        //Blend with the next row down via the lookup table
+        uint8_t *bottom = top + src->pitch;
+        if (src->packed)
+        {
+            VL_T4_ReadRow(src, scrlX, _y + 1, width, line[1]);
+            bottom = line[1];
+        }
+        const uint16_t *blend = palette_blend[weight - 1];
+        for (int _x = 0; _x < width; _x++)
+        {
+            dest_row[_x] = blend[(top[_x] << 4) | bottom[_x]];
+        }
+    }
+}
+
+//Copy the presented window for frame capture, as 4 bit pixels with the left one in the low nibble.
+static void VL_T4_CaptureFrame(VL_T4_Surface *src, int scrlX, int scrlY)
+{
+    uint8_t *frame = CAP_T4_BeginFrame();
+    if (frame == NULL)
+    {
+        return;
+    }
+    for (int y = 0; y < CAP_T4_HEIGHT; y++)
+    {
+        uint8_t *out = &frame[y * (CAP_T4_WIDTH / 2)];
+        if (src->packed && !(scrlX & 1))
+        {
+            memcpy(out, &src->pixels[(y + scrlY) * src->pitch + scrlX / 2], CAP_T4_WIDTH / 2);
+        }
+        else if (!src->packed)
+        {
+            const uint8_t *in = &src->pixels[(y + scrlY) * src->pitch + scrlX];
+            for (int x = 0; x < CAP_T4_WIDTH / 2; x++)
+            {
+                out[x] = (in[x * 2] & 0xF) | (in[x * 2 + 1] << 4);
+            }
+        }
+        else
+        {
+            const uint8_t *in = &src->pixels[(y + scrlY) * src->pitch + scrlX / 2];
+            for (int x = 0; x < CAP_T4_WIDTH / 2; x++)
+            {
+                out[x] = VL_T4_ShiftedPair(in, x);
+            }
+        }
+    }
+    CAP_T4_EndFrame(palette);
+}
+
+static void VL_T4_PrintStats()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        VL_T4_PresentStats *s = &present_stats[i];
+        printf("VL: %s scale %lu cycles/frame avg, %lu max over %lu frames\n", (i == 0) ? "nearest" : "smooth",
+               s->frames ? s->total_cycles / s->frames : 0, s->max_cycles, s->frames);
+    }
+    if (present_stats[0].frames && present_stats[1].frames)
+    {
+        uint32_t nearest = present_stats[0].total_cycles / present_stats[0].frames;
+        uint32_t smooth = present_stats[1].total_cycles / present_stats[1].frames;
+        printf("VL: smooth scale costs %lu%% of nearest\n", (uint32_t)((uint64_t)smooth * 100 / CK_Cross_max(1, nearest)));
+    }
+    VL_T4_PipelineStats *p = &pipeline_stats;
+    uint32_t handoffs = CK_Cross_max(1, p->handoffs_idle + p->handoffs_blocking);
+    printf("VL: handoff %lu idle, %lu blocking. wait %lu us avg, %lu us max. update %lu us avg\n",
+           p->handoffs_idle, p->handoffs_blocking, p->wait_us_total / handoffs, p->wait_us_max,
+           p->update_us_total / handoffs);
+    VL_T4_DeferStats *d = &defer.stats;
+    if (d->flushes)
+    {
+        printf("VL: deferred %lu cmds, %lu flushes (%lu early), %lu cycles/flush avg, %lu max, arena peak %lu bytes\n",
+               d->cmds, d->flushes, d->early_flushes, d->total_cycles / d->flushes, d->max_cycles, d->arena_peak);
+        printf("VL: deferred overdraw %lu pixels drawn into %lu merged, %lu cmds culled (%lu pixels)\n",
+               d->pixels_drawn, d->pixels_merged, d->culled, d->pixels_culled);
+    }
+    if (gfx_fallback.direct || gfx_fallback.dropped)
+    {
+        printf("VL: out of memory expanding graphics: %lu drawn directly, %lu dropped\n", gfx_fallback.direct,
+               gfx_fallback.dropped);
+    }
+    memset(present_stats, 0, sizeof(present_stats));
+    memset(&pipeline_stats, 0, sizeof(pipeline_stats));
+    memset(d, 0, sizeof(*d));
+    memset(&gfx_fallback, 0, sizeof(gfx_fallback));
+}
+
+static void VL_T4_PresentHandoff()
+{
+    uint32_t start = micros();
     tft.update(tft_buffer);
+    pipeline_stats.update_us_total += micros() - start;
+    present_pending = false;
+}
+
+//Hand the pending frame to the driver if it has finished with the last one. Returns true if nothing is left pending.
+static bool VL_T4_PresentService()
+{
+    if (present_pending && !tft.asyncUpdateActive())
+    {
+        VL_T4_PresentHandoff();
+        pipeline_stats.handoffs_idle++;
+    }
+    return !present_pending;
+}
+
+uint32_t VL_T4_PresentFlush()
+{
+    if (VL_T4_PresentService())
+    {
+        return 0;
+    }
+    uint32_t wait_start = micros();
+    while (tft.asyncUpdateActive())
+    {
+        yield();
+    }
+    uint32_t waited = micros() - wait_start;
+    pipeline_stats.wait_us_total += waited;
+    pipeline_stats.wait_us_max = CK_Cross_max(pipeline_stats.wait_us_max, waited);
+    VL_T4_PresentHandoff();
+    pipeline_stats.handoffs_blocking++;
+    return waited;
+}
+
+static void VL_T4_Present(void *surface, int scrlX, int scrlY, bool singleBuffered)
+{
+    //tft_buffer is about to be overwritten, so a frame still waiting in it has to go now.
+    uint32_t waited = VL_T4_PresentFlush();
+
+    VL_T4_Surface *src = (VL_T4_Surface *)surface;
+    VL_T4_DeferFlush();
+    VL_T4_CowRead(src, scrlX, scrlY, 320, 200);
+    uint32_t start = ARM_DWT_CYCCNT;
+    if (smooth_scale)
+    {
+        VL_T4_PresentSmooth(src, scrlX, scrlY);
+    }
+    else if (src->packed)
+    {
+        VL_T4_PresentNearestPacked(src, scrlX, scrlY);
+    }
+    else
+    {
+        VL_T4_PresentNearest(src, scrlX, scrlY);
+    }
+
+    uint32_t cycles = ARM_DWT_CYCCNT - start;
+    if (CAP_T4_Active())
+    {
+        VL_T4_CaptureFrame(src, scrlX, scrlY);
+    }
+    VL_T4_PresentStats *stats = &present_stats[smooth_scale ? 1 : 0];
+    stats->frames++;
+    stats->total_cycles += cycles;
+    stats->max_cycles = CK_Cross_max(stats->max_cycles, cycles);
+    REC_T4_Frame(cycles / (F_CPU_ACTUAL / 1000000), waited);
+#if VL_T4_STATS_INTERVAL > 0
+    if (stats->frames % VL_T4_STATS_INTERVAL == 0)
+    {
+        VL_T4_PrintStats();
+    }
+#endif
+
+    present_pending = true;
+    VL_T4_PresentService();
 }
 
+//Background work such as prefetching gets part of the idle time each frame. It is never started
+//closer than VL_T4_IDLE_MARGIN_US to the end of the frame, so it can't make the game miss one.
+#ifndef VL_T4_IDLE_BUDGET_US
+#define VL_T4_IDLE_BUDGET_US 4000
+#endif
+#define VL_T4_IDLE_MARGIN_US 2000
+
 static void VL_T4_WaitVBLs(int vbls)
 {
     //Original game runs at 35 fps, wait n * vbls @ 35fps
     static int frame_start_time = 0;
+    int32_t frame_us = 1000000 * vbls / 35;
+    int32_t idle_used = 0;
     do
     {
+        VL_T4_PresentService();
+        CON_T4_Poll();
+        MEM_T4_Poll();
+        REC_T4_Poll();
+        int32_t budget = frame_us - (int32_t)(micros() - frame_start_time) - VL_T4_IDLE_MARGIN_US;
+        budget = CK_Cross_min(budget, VL_T4_IDLE_BUDGET_US - idle_used);
+        if (budget > 0)
+        {
+            uint32_t start = micros();
+            FS_T4_Poll(budget);
+            CAP_T4_Poll(budget - (int32_t)(micros() - start));
+            idle_used += micros() - start;
+        }
         yield();
     } while (micros() - frame_start_time < (1000000 * vbls / 35));
     frame_start_time = micros();
@@ -122,7 +1095,10 @@ static void *VL_T4_CreateSurface(int w, int h, VL_SurfaceUsage usage)
     surf->width = w;
     surf->height = h;
     surf->use = usage;
-    
+    surf->packed = VL_T4_PACKED_SURFACES;
+    surf->pitch = VL_T4_PITCH(w);
+    int bytes = surf->pitch * h;
+
     //Memory preference is RAM1 then RAM2 the external RAM (fastest to slowest)
 
     //Attempt in RAM1 (We want to use the main front buffer for this)
@@ -132,27 +1108,31 @@ static void *VL_T4_CreateSurface(int w, int h, VL_SurfaceUsage usage)
         {
             surf->pixels = front_buffer;
             front_buffer_in_use = true;
+            MEM_T4_TrackAlloc(surf->pixels, bytes, MEM_T4_TAG_SURFACE);
             return surf;
         }
-        printf("Warning: Front buffer already in use. Attempting RAM2\n");
+        LOG_T4_WARN("VL: Front buffer already in use. Attempting RAM2\n");
     }
 
     //Attempt in RAM2
-    surf->pixels = (uint8_t *)malloc(w * h);
+    surf->pixels = (uint8_t *)malloc(bytes);
     if (surf->pixels != NULL)
     {
+        MEM_T4_TrackAlloc(surf->pixels, bytes, MEM_T4_TAG_SURFACE);
         return surf;
     }
 
     //Attempt in EXTMEM
-    printf("Warning: Could not malloc surface internally. Attempting EXTMEM\n");
-    surf->pixels = (uint8_t *)extmem_malloc(w * h);
+    LOG_T4_WARN("VL: Could not malloc surface internally. Attempting EXTMEM\n");
+    surf->pixels = (uint8_t *)extmem_malloc(bytes);
     if (surf->pixels != NULL)
     {
+        MEM_T4_TrackAlloc(surf->pixels, bytes, MEM_T4_TAG_SURFACE);
         return surf;
     }
 
-    printf("Could not malloc surface %d bytes\n", w * h);
+    LOG_T4_FATAL("VL: Could not malloc surface %d bytes\n", bytes);
+    REC_T4_Record(REC_T4_FATAL, REC_T4_FATAL_SURFACE, bytes, 0);
     while (1) yield();
     return NULL;
 }
@@ -164,6 +1144,16 @@ static void VL_T4_DestroySurface(void *surface)
     {
         return;
     }
+    VL_T4_DeferFlush();
+    if (surf == cow.snap)
+    {
+        VL_T4_CowDrop();
+    }
+    else if (surf == cow.src)
+    {
+        VL_T4_CowRelease();
+    }
+    MEM_T4_TrackFree(surf->pixels);
     if (surf->pixels == front_buffer) 
     {
         front_buffer_in_use = false;
@@ -182,7 +1172,7 @@ static void VL_T4_DestroySurface(void *surface)
 static long VL_T4_GetSurfaceMemUse(void *surface)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)surface;
-    return surf->width * surf->height;
+    return surf->pitch * surf->height;
 }
 
 static void VL_T4_GetSurfaceDimensions(void *surface, int *w, int *h)
@@ -194,29 +1184,82 @@ static void VL_T4_GetSurfaceDimensions(void *surface, int *w, int *h)
 
 static void VL_T4_RefreshPaletteAndBorderColor(void *screen)
 {
-    uint8_t r, g, b;
+    const uint8_t *rgb[16];
     for (int i = 0; i < 16; i++)
     {
-        r = VL_EGARGBColorTable[vl_emuegavgaadapter.palette[i]][0];
-        g = VL_EGARGBColorTable[vl_emuegavgaadapter.palette[i]][1];
-        b = VL_EGARGBColorTable[vl_emuegavgaadapter.palette[i]][2];
-        uint16_t c = ((r >> 3) << 11) | ((g >> 2) << 5) | ((b >> 3) << 0); //rgb 565 for the TFT
-        palette[i] = c;
+        rgb[i] = VL_EGARGBColorTable[vl_emuegavgaadapter.palette[i]];
+        palette[i] = VL_T4_RGB565(rgb[i][0], rgb[i][1], rgb[i][2]);
+    }
+    for (int i = 0; i < 256; i++)
+    {
+        palette_pair[i] = palette[i & 0xF] | (palette[i >> 4] << 16);
+    }
+
+    //Blend every colour pair at each weight for the smooth scaler.
+    for (int w = 1; w < 6; w++)
+    {
+        uint16_t *blend = palette_blend[w - 1];
+        for (int top = 0; top < 16; top++)
+        {
+            for (int bottom = 0; bottom < 16; bottom++)
+            {
+                int r = (rgb[top][0] * (6 - w) + rgb[bottom][0] * w) / 6;
+                int g = (rgb[top][1] * (6 - w) + rgb[bottom][1] * w) / 6;
+                int b = (rgb[top][2] * (6 - w) + rgb[bottom][2] * w) / 6;
+                blend[(top << 4) | bottom] = VL_T4_RGB565(r, g, b);
+            }
+        }
     }
 }
 
 static int VL_T4_SurfacePGet(void *surface, int x, int y)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)surface;
-    return ((uint8_t *)surf->pixels)[y * surf->width + x];
+    VL_T4_DeferFlush();
+    if (surf == cow.snap && cow.src != NULL && cow.shared[(y / VL_T4_COW_TILE) * cow.tiles_x + (x / VL_T4_COW_TILE)])
+    {
+        surf = cow.src;
+    }
+    return VL_T4_GetPixel(surf, x, y);
+}
+
+//Clip a w x h rectangle at x, y to the surface. ox and oy are moved by the same amount as x and y,
+//so the other side of a copy stays lined up. Returns false if nothing is left to draw.
+static bool VL_T4_Clip(VL_T4_Surface *surf, int *x, int *y, int *w, int *h, int *ox, int *oy)
+{
+    if (*x < 0)
+    {
+        *w += *x;
+        *ox -= *x;
+        *x = 0;
+    }
+    if (*y < 0)
+    {
+        *h += *y;
+        *oy -= *y;
+        *y = 0;
+    }
+    *w = CK_Cross_min(*w, surf->width - *x);
+    *h = CK_Cross_min(*h, surf->height - *y);
+    return *w > 0 && *h > 0;
 }
 
 static void VL_T4_SurfaceRect(void *dst_surface, int x, int y, int w, int h, int colour)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
+    int unused_x = 0, unused_y = 0;
+    if (!VL_T4_Clip(surf, &x, &y, &w, &h, &unused_x, &unused_y))
+    {
+        return;
+    }
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (VL_T4_DeferFill(surf, x, y, w, h, 0, colour))
+    {
+        return;
+    }
     for (int _y = y; _y < y + h; ++_y)
     {
-        memset(((uint8_t *)surf->pixels) + (_y * surf->width) + x, colour, CK_Cross_min(w, surf->width - x));
+        VL_T4_ApplySpan(surf, x, _y, w, 0, colour);
     }
 }
 
@@ -226,14 +1269,19 @@ static void VL_T4_SurfaceRect_PM(void *dst_surface, int x, int y, int w, int h,
     colour &= mapmask;
 
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
+    int unused_x = 0, unused_y = 0;
+    if (!VL_T4_Clip(surf, &x, &y, &w, &h, &unused_x, &unused_y))
+    {
+        return;
+    }
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (VL_T4_DeferFill(surf, x, y, w, h, ~mapmask, colour))
+    {
+        return;
+    }
     for (int _y = y; _y < y + h; ++_y)
     {
-        for (int _x = x; _x < x + w; ++_x)
-        {
-            uint8_t *p = ((uint8_t *)surf->pixels) + _y * surf->width + _x;
-            *p &= ~mapmask;
-            *p |= colour;
-        }
+        VL_T4_ApplySpan(surf, x, _y, w, ~mapmask, colour);
     }
 }
 
@@ -241,15 +1289,44 @@ static void VL_T4_SurfaceToSurface(void *src_surface, void *dst_surface, int x,
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)src_surface;
     VL_T4_Surface *dest = (VL_T4_Surface *)dst_surface;
+    if (!VL_T4_Clip(surf, &sx, &sy, &sw, &sh, &x, &y) || !VL_T4_Clip(dest, &x, &y, &sw, &sh, &sx, &sy))
+    {
+        return;
+    }
+
+    //Whole surface copies become copy-on-write snapshots
+    if (x == 0 && y == 0 && sx == 0 && sy == 0 && sw == surf->width && sh == surf->height)
+    {
+        if (surf == cow.snap)
+        {
+            VL_T4_RestoreSnapshot(surf, dest);
+        }
+        else
+        {
+            VL_T4_SnapshotSurface(surf, dest);
+        }
+        return;
+    }
+
+    VL_T4_DeferFlush();
+    VL_T4_CowRead(surf, sx, sy, sw, sh);
+    VL_T4_CowUnshare(dest, x, y, sw, sh);
     for (int _y = sy; _y < sy + sh; ++_y)
     {
-        memcpy(((uint8_t *)dest->pixels) + (_y - sy + y) * dest->width + x, ((uint8_t *)surf->pixels) + _y * surf->width + sx, sw);
+        VL_T4_CopyRow(dest, x, _y - sy + y, surf, sx, _y, sw);
     }
 }
 
 static void VL_T4_SurfaceToSelf(void *surface, int x, int y, int sx, int sy, int sw, int sh)
 {
     VL_T4_Surface *srf = (VL_T4_Surface *)surface;
+    if (!VL_T4_Clip(srf, &sx, &sy, &sw, &sh, &x, &y) || !VL_T4_Clip(srf, &x, &y, &sw, &sh, &sx, &sy))
+    {
+        return;
+    }
+    VL_T4_DeferFlush();
+    VL_T4_CowRead(srf, sx, sy, sw, sh);
+    VL_T4_CowUnshare(srf, x, y, sw, sh);
     bool directionX = sx > x;
     bool directionY = sy > y;
 
@@ -257,70 +1334,214 @@ static void VL_T4_SurfaceToSelf(void *surface, int x, int y, int sx, int sy, int
     {
         for (int yi = 0; yi < sh; ++yi)
         {
-            memmove(((uint8_t *)srf->pixels) + ((yi + y) * srf->width + x), ((uint8_t *)srf->pixels) + ((sy + yi) * srf->width + sx), sw);
+            VL_T4_CopyRow(srf, x, yi + y, srf, sx, sy + yi, sw);
         }
     }
     else
     {
         for (int yi = sh - 1; yi >= 0; --yi)
         {
-            memmove(((uint8_t *)srf->pixels) + ((yi + y) * srf->width + x), ((uint8_t *)srf->pixels) + ((sy + yi) * srf->width + sx), sw);
+            VL_T4_CopyRow(srf, x, yi + y, srf, sx, sy + yi, sw);
         }
     }
 }
 
+//Draw a graphic from the expanded graphics cache, clipped to the surface.
+static void VL_T4_DrawExpanded(VL_T4_Surface *surf, const VL_T4_Expanded *gfx, int x, int y)
+{
+    int x0 = CK_Cross_max(0, -x), x1 = CK_Cross_min(gfx->w, surf->width - x);
+    int y0 = CK_Cross_max(0, -y), y1 = CK_Cross_min(gfx->h, surf->height - y);
+    int w = x1 - x0;
+    if (w <= 0 || y0 >= y1)
+    {
+        return;
+    }
+    if (surf->packed)
+    {
+        for (int _y = y0; _y < y1; _y++)
+        {
+            const uint8_t *colour = &gfx->colour[_y * gfx->w + x0];
+            if (gfx->mask == NULL)
+            {
+                VL_T4_WriteRow(surf, x + x0, y + _y, w, colour);
+                continue;
+            }
+            const uint8_t *mask = &gfx->mask[_y * gfx->w + x0];
+            for (int _x = 0; _x < w; _x++)
+            {
+                int p = VL_T4_GetPixel(surf, x + x0 + _x, y + _y);
+                VL_T4_SetPixel(surf, x + x0 + _x, y + _y, (p & mask[_x]) ^ colour[_x]);
+            }
+        }
+        return;
+    }
+
+    for (int _y = y0; _y < y1; _y++)
+    {
+        uint8_t *dst = &surf->pixels[(y + _y) * surf->pitch + x + x0];
+        const uint8_t *colour = &gfx->colour[_y * gfx->w + x0];
+        if (gfx->mask == NULL)
+        {
+            memcpy(dst, colour, w);
+            continue;
+        }
+        const uint8_t *mask = &gfx->mask[_y * gfx->w + x0];
+        for (int _x = 0; _x < w; _x++)
+        {
+            dst[_x] = (dst[_x] & mask[_x]) ^ colour[_x];
+        }
+    }
+}
+
+//Working space for expanding graphics that can't come from the cache. Grows as needed.
+static uint8_t *VL_T4_Scratch(int size)
+{
+    static uint8_t *scratch = NULL;
+    static int scratch_size = 0;
+    if (size > scratch_size)
+    {
+        uint8_t *p = (uint8_t *)extmem_realloc(scratch, size);
+        if (p == NULL)
+        {
+            LOG_T4_ERROR("%s: Could not allocate %d bytes\n", __FUNCTION__, size);
+            return NULL;
+        }
+        scratch = p;
+        scratch_size = size;
+    }
+    return scratch;
+}
+
+//Draw a graphic in its expanded form, taken from the cache if possible. Graphics that aren't cached are only
+//expanded when they have to be, for packed surfaces and deferred drawing, as the PAL8 routines can't do either.
+//Returns false if the caller should run the PAL8 routine directly instead.
+static bool VL_T4_DrawGfx(VL_T4_Surface *surf, VL_T4_GfxOp op, void *src, int x, int y, int w, int h, int colour, int mapmask)
+{
+    bool deferred = VL_T4_DeferEligible(surf);
+    VL_T4_Expanded gfx;
+    if (op > VL_T4_GFX_MASKED_CLIP || !VL_T4_GfxCacheLookup(src, w, h, op, mapmask & 0xF, &gfx))
+    {
+        if (!surf->packed && !deferred)
+        {
+            return false;
+        }
+        int size = w * h;
+        uint8_t *scratch = VL_T4_Scratch(size * 2);
+        if (scratch == NULL && surf->packed)
+        {
+            gfx_fallback.dropped++;
+            return true;
+        }
+        if (scratch == NULL)
+        {
+            //Draw directly, after anything already recorded for this surface so the order is kept
+            VL_T4_DeferFlush();
+            gfx_fallback.direct++;
+            return false;
+        }
+        VL_T4_GfxDraw draw = {op, src, w, h, colour, mapmask};
+        gfx = {w, h, scratch, scratch + size};
+        if (!VL_T4_Expand(&draw, scratch, scratch + size))
+        {
+            gfx.mask = NULL;
+        }
+    }
+    if (deferred && VL_T4_DeferGfx(surf, &gfx, x, y))
+    {
+        return true;
+    }
+    VL_T4_DrawExpanded(surf, &gfx, x, y);
+    return true;
+}
+
 static void VL_T4_UnmaskedToSurface(void *src, void *dst_surface, int x, int y, int w, int h)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_UnmaskedToPAL8(src, surf->pixels, x, y, surf->width, w, h);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_UNMASKED, src, x, y, w, h, 0, 0))
+    {
+        VL_UnmaskedToPAL8(src, surf->pixels, x, y, surf->width, w, h);
+    }
 }
 
 static void VL_T4_UnmaskedToSurface_PM(void *src, void *dst_surface, int x, int y, int w, int h, int mapmask)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_UnmaskedToPAL8_PM(src, surf->pixels, x, y, surf->width, w, h, mapmask);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_UNMASKED_PM, src, x, y, w, h, 0, mapmask))
+    {
+        VL_UnmaskedToPAL8_PM(src, surf->pixels, x, y, surf->width, w, h, mapmask);
+    }
 }
 
 static void VL_T4_MaskedToSurface(void *src, void *dst_surface, int x, int y, int w, int h)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_MaskedToPAL8(src, surf->pixels, x, y, surf->width, w, h);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_MASKED, src, x, y, w, h, 0, 0))
+    {
+        VL_MaskedToPAL8(src, surf->pixels, x, y, surf->width, w, h);
+    }
 }
 
 static void VL_T4_MaskedBlitToSurface(void *src, void *dst_surface, int x, int y, int w, int h)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_MaskedBlitClipToPAL8(src, surf->pixels, x, y, surf->width, w, h, surf->width, surf->height);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_MASKED_CLIP, src, x, y, w, h, 0, 0))
+    {
+        VL_MaskedBlitClipToPAL8(src, surf->pixels, x, y, surf->width, w, h, surf->width, surf->height);
+    }
 }
 
 static void VL_T4_BitToSurface(void *src, void *dst_surface, int x, int y, int w, int h, int colour)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_1bppToPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_BIT, src, x, y, w, h, colour, 0))
+    {
+        VL_1bppToPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    }
 }
 
 static void VL_T4_BitToSurface_PM(void *src, void *dst_surface, int x, int y, int w, int h, int colour, int mapmask)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_1bppToPAL8_PM(src, surf->pixels, x, y, surf->width, w, h, colour, mapmask);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_BIT_PM, src, x, y, w, h, colour, mapmask))
+    {
+        VL_1bppToPAL8_PM(src, surf->pixels, x, y, surf->width, w, h, colour, mapmask);
+    }
 }
 
 static void VL_T4_BitXorWithSurface(void *src, void *dst_surface, int x, int y, int w, int h, int colour)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_1bppXorWithPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_BIT_XOR, src, x, y, w, h, colour, 0))
+    {
+        VL_1bppXorWithPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    }
 }
 
 static void VL_T4_BitBlitToSurface(void *src, void *dst_surface, int x, int y, int w, int h, int colour)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_1bppBlitToPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_BIT_BLIT, src, x, y, w, h, colour, 0))
+    {
+        VL_1bppBlitToPAL8(src, surf->pixels, x, y, surf->width, w, h, colour);
+    }
 }
 
 static void VL_T4_BitInvBlitToSurface(void *src, void *dst_surface, int x, int y, int w, int h, int colour)
 {
     VL_T4_Surface *surf = (VL_T4_Surface *)dst_surface;
-    VL_1bppInvBlitClipToPAL8(src, surf->pixels, x, y, surf->width, w, h, surf->width, surf->height, colour);
+    VL_T4_CowUnshare(surf, x, y, w, h);
+    if (!VL_T4_DrawGfx(surf, VL_T4_GFX_BIT_INVBLIT, src, x, y, w, h, colour, 0))
+    {
+        VL_1bppInvBlitClipToPAL8(src, surf->pixels, x, y, surf->width, w, h, surf->width, surf->height, colour);
+    }
 }
 
 static int VL_T4_GetActiveBufferId(void *surface)
@@ -365,6 +1586,7 @@ static void VL_T4_ScrollSurface(void *surface, int x, int y)
 
 static void VL_T4_FlushParams()
 {
+    VL_T4_DeferFlush();
 }
 
 VL_Backend vl_t4_backend =
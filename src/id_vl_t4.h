@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_VL_T4_H
+#define ID_VL_T4_H
+
+//Teensy specific extensions to the VL backend.
+
+//Initialise the display. Safe to call again when the game sets the video mode.
+void VL_T4_Startup();
+//Start sending a splash frame. Returns once the transfer has started.
+void VL_T4_ShowSplash();
+//Hand a presented frame that is still waiting for the display to the driver, waiting for the previous
+//transfer if needed. Call before blocking work. Returns the microseconds spent waiting.
+uint32_t VL_T4_PresentFlush();
+
+//Make snap a copy-on-write copy of src. Both surfaces must be the same size.
+void VL_T4_SnapshotSurface(void *src_surface, void *snap_surface);
+//Copy snap back to dst. Only changed tiles are copied if snap is a snapshot of dst.
+void VL_T4_RestoreSnapshot(void *snap_surface, void *dst_surface);
+
+#endif
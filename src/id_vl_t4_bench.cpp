@@ -0,0 +1,570 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <Arduino.h>
+#include "id_vl_t4_bench.h"
+#include "id_con_t4.h"
+#include "id_vl_t4_cache.h"
+
+extern "C"
+{
+#include "printf.h"
+#include "id_vl.h"
+#include "id_vl_private.h"
+#include "ck_cross.h"
+}
+
+#if VL_T4_BENCH
+static const int CHECK_EVERY = 8;
+static const int CLIP_MARGIN = 24; //How far outside the surface a clipped rectangle can start
+static const int PRESENT_FRAMES = 8;
+
+//Graphics are drawn from a few slots, so the expanded graphics cache sees both misses and hits
+static const int GFX_SLOTS = 8;
+static const int GFX_MAX_W = 64;
+static const int GFX_MAX_H = 48;
+static const int GFX_SLOT_BYTES = (GFX_MAX_W / 8) * GFX_MAX_H * 5;
+
+//The odd size covers the half byte edges of packed surfaces
+static const int SURFACE_SIZES[][2] = {{176, 120}, {61, 45}};
+
+#define VL_T4_BENCH_TIME(call)                  \
+    do                                          \
+    {                                           \
+        uint32_t start = ARM_DWT_CYCCNT;        \
+        call;                                   \
+        bench.cycles += ARM_DWT_CYCCNT - start; \
+    } while (0)
+
+//The reference blitters are omnispeak's direct PAL8 conversion, which the expanded graphics cache replaces,
+//so they are timed too for comparison
+#define VL_T4_BENCH_TIME_REF(call)                  \
+    do                                              \
+    {                                               \
+        uint32_t start = ARM_DWT_CYCCNT;            \
+        call;                                       \
+        bench.ref_cycles += ARM_DWT_CYCCNT - start; \
+    } while (0)
+
+typedef enum VL_T4_BenchWhere
+{
+    VL_T4_BENCH_INSIDE,       //Entirely on the surface
+    VL_T4_BENCH_RIGHT_BOTTOM, //Can hang off the right and bottom, for the clipping blitters
+    VL_T4_BENCH_ANYWHERE,     //Can hang off any side, or miss the surface entirely
+} VL_T4_BenchWhere;
+
+//One byte per pixel copy of a backend surface
+typedef struct VL_T4_BenchRef
+{
+    int w, h;
+    uint8_t *px;
+} VL_T4_BenchRef;
+
+//Parameters of a call, printed if it leads to a mismatch
+typedef struct VL_T4_BenchOp
+{
+    int x, y, w, h;
+    int sx, sy;
+    int arg;
+} VL_T4_BenchOp;
+
+typedef struct VL_T4_BenchGfx
+{
+    int w, h;
+    uint8_t *data;
+} VL_T4_BenchGfx;
+
+typedef struct VL_T4_BenchTest
+{
+    const char *name;
+    void (*run)(VL_T4_BenchOp *op);
+} VL_T4_BenchTest;
+
+static struct
+{
+    VL_Backend *vl;
+    uint32_t seed;
+    void *surf, *other;
+    VL_T4_BenchRef ref, ref_other, ref_tmp;
+    VL_T4_BenchGfx gfx[GFX_SLOTS];
+    const uint8_t *src; //Graphic for the current call
+    uint32_t cycles;
+    uint32_t ref_cycles;
+    uint32_t pixels;
+    VL_T4_BenchOp window[CHECK_EVERY];
+} bench;
+
+static uint32_t VL_T4_BenchRand(uint32_t n)
+{
+    bench.seed ^= bench.seed << 13;
+    bench.seed ^= bench.seed >> 17;
+    bench.seed ^= bench.seed << 5;
+    return n ? bench.seed % n : 0;
+}
+
+static int VL_T4_BenchRange(int lo, int hi)
+{
+    return lo + (int)VL_T4_BenchRand(hi - lo + 1);
+}
+
+static inline bool VL_T4_BenchInside(const VL_T4_BenchRef *r, int x, int y)
+{
+    return x >= 0 && y >= 0 && x < r->w && y < r->h;
+}
+
+//p = (p & and_mask) ^ xor_val over the part of the rectangle on the surface
+static uint32_t VL_T4_BenchRefFill(VL_T4_BenchRef *r, int x, int y, int w, int h, uint8_t and_mask, uint8_t xor_val)
+{
+    uint32_t n = 0;
+    for (int _y = y; _y < y + h; _y++)
+    {
+        for (int _x = x; _x < x + w; _x++)
+        {
+            if (VL_T4_BenchInside(r, _x, _y))
+            {
+                uint8_t *p = &r->px[_y * r->w + _x];
+                *p = (*p & and_mask) ^ xor_val;
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+//Only pixels that are on both surfaces are copied. src must not be dst.
+static uint32_t VL_T4_BenchRefCopy(VL_T4_BenchRef *dst, const VL_T4_BenchRef *src, int x, int y, int sx, int sy, int sw, int sh)
+{
+    uint32_t n = 0;
+    for (int j = 0; j < sh; j++)
+    {
+        for (int i = 0; i < sw; i++)
+        {
+            if (VL_T4_BenchInside(src, sx + i, sy + j) && VL_T4_BenchInside(dst, x + i, y + j))
+            {
+                dst->px[(y + j) * dst->w + x + i] = src->px[(sy + j) * src->w + sx + i];
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+static void VL_T4_BenchRandomise(void *surface, VL_T4_BenchRef *r)
+{
+    for (int y = 0; y < r->h; y++)
+    {
+        for (int x = 0; x < r->w; x++)
+        {
+            int c = VL_T4_BenchRand(16);
+            r->px[y * r->w + x] = c;
+            bench.vl->surfaceRect(surface, x, y, 1, 1, c);
+        }
+    }
+}
+
+static void VL_T4_BenchPlace(VL_T4_BenchOp *op, int w, int h, VL_T4_BenchWhere where)
+{
+    const VL_T4_BenchRef *r = &bench.ref;
+    *op = {0, 0, w, h, 0, 0, 0};
+    switch (where)
+    {
+    case VL_T4_BENCH_INSIDE:
+        op->x = VL_T4_BenchRange(0, r->w - w);
+        op->y = VL_T4_BenchRange(0, r->h - h);
+        break;
+    case VL_T4_BENCH_RIGHT_BOTTOM:
+        op->x = VL_T4_BenchRange(0, r->w - 1);
+        op->y = VL_T4_BenchRange(0, r->h - 1);
+        break;
+    default:
+        op->x = VL_T4_BenchRange(-CLIP_MARGIN - w, r->w + CLIP_MARGIN);
+        op->y = VL_T4_BenchRange(-CLIP_MARGIN - h, r->h + CLIP_MARGIN);
+        break;
+    }
+}
+
+//A rectangle of any size up to the surface's, including empty ones, anywhere
+static void VL_T4_BenchPlaceRect(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchPlace(op, VL_T4_BenchRange(0, bench.ref.w), VL_T4_BenchRange(0, bench.ref.h), VL_T4_BENCH_ANYWHERE);
+}
+
+//Picks a graphic slot, sometimes refilling it with a new size and random EGA data, and places it.
+//arg is the slot.
+static void VL_T4_BenchGraphic(VL_T4_BenchOp *op, VL_T4_BenchWhere where)
+{
+    int slot = VL_T4_BenchRand(GFX_SLOTS);
+    VL_T4_BenchGfx *g = &bench.gfx[slot];
+    if (g->w == 0 || VL_T4_BenchRand(4) == 0)
+    {
+        //No larger than the surface, so it can be placed inside it
+        g->w = VL_T4_BenchRange(1, CK_Cross_min(GFX_MAX_W, bench.ref.w));
+        g->h = VL_T4_BenchRange(1, CK_Cross_min(GFX_MAX_H, bench.ref.h));
+        for (int i = 0; i < GFX_SLOT_BYTES; i++)
+        {
+            g->data[i] = VL_T4_BenchRand(256);
+        }
+        //As the mm hooks do when the game reuses a graphics chunk
+        VL_T4_GfxCacheInvalidate(g->data, GFX_SLOT_BYTES);
+    }
+    VL_T4_BenchPlace(op, g->w, g->h, where);
+    op->arg = slot;
+    bench.src = g->data;
+}
+
+static uint32_t VL_T4_BenchClippedArea(const VL_T4_BenchOp *op)
+{
+    return CK_Cross_max(0, CK_Cross_min(op->w, bench.ref.w - op->x)) *
+           CK_Cross_max(0, CK_Cross_min(op->h, bench.ref.h - op->y));
+}
+
+static void VL_T4_BenchRect(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchPlaceRect(op);
+    op->arg = VL_T4_BenchRand(16);
+    bench.pixels += VL_T4_BenchRefFill(&bench.ref, op->x, op->y, op->w, op->h, 0, op->arg);
+    VL_T4_BENCH_TIME(bench.vl->surfaceRect(bench.surf, op->x, op->y, op->w, op->h, op->arg));
+}
+
+//arg is colour | mapmask << 4
+static void VL_T4_BenchRectPM(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchPlaceRect(op);
+    op->arg = VL_T4_BenchRand(256);
+    int colour = op->arg & 0xF, mapmask = op->arg >> 4;
+    bench.pixels += VL_T4_BenchRefFill(&bench.ref, op->x, op->y, op->w, op->h, ~mapmask & 0xF, colour & mapmask);
+    VL_T4_BENCH_TIME(bench.vl->surfaceRect_PM(bench.surf, op->x, op->y, op->w, op->h, colour, mapmask));
+}
+
+//arg is 1 for a whole surface copy from other, which becomes a snapshot, and 2 for one back to other
+static void VL_T4_BenchToSurface(VL_T4_BenchOp *op)
+{
+    //Draw on the source too, so snapshot tiles are unshared from both sides
+    if (VL_T4_BenchRand(4) == 0)
+    {
+        int x = VL_T4_BenchRand(bench.ref.w), y = VL_T4_BenchRand(bench.ref.h), c = VL_T4_BenchRand(16);
+        VL_T4_BenchRefFill(&bench.ref_other, x, y, 24, 24, 0, c);
+        bench.vl->surfaceRect(bench.other, x, y, 24, 24, c);
+    }
+
+    if (VL_T4_BenchRand(16) == 0)
+    {
+        VL_T4_BenchRef *r = &bench.ref;
+        *op = {0, 0, r->w, r->h, 0, 0, 1 + (int)VL_T4_BenchRand(2)};
+        bench.pixels += r->w * r->h;
+        if (op->arg == 1)
+        {
+            memcpy(r->px, bench.ref_other.px, r->w * r->h);
+            VL_T4_BENCH_TIME(bench.vl->surfaceToSurface(bench.other, bench.surf, 0, 0, 0, 0, r->w, r->h));
+        }
+        else
+        {
+            memcpy(bench.ref_other.px, r->px, r->w * r->h);
+            VL_T4_BENCH_TIME(bench.vl->surfaceToSurface(bench.surf, bench.other, 0, 0, 0, 0, r->w, r->h));
+        }
+        return;
+    }
+
+    VL_T4_BenchPlaceRect(op);
+    op->sx = VL_T4_BenchRange(-CLIP_MARGIN - op->w, bench.ref.w + CLIP_MARGIN);
+    op->sy = VL_T4_BenchRange(-CLIP_MARGIN - op->h, bench.ref.h + CLIP_MARGIN);
+    bench.pixels += VL_T4_BenchRefCopy(&bench.ref, &bench.ref_other, op->x, op->y, op->sx, op->sy, op->w, op->h);
+    VL_T4_BENCH_TIME(bench.vl->surfaceToSurface(bench.other, bench.surf, op->x, op->y, op->sx, op->sy, op->w, op->h));
+}
+
+static void VL_T4_BenchToSelf(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchPlaceRect(op);
+    //Mostly overlapping, in every direction
+    op->sx = op->x + VL_T4_BenchRange(-16, 16);
+    op->sy = op->y + VL_T4_BenchRange(-16, 16);
+    memcpy(bench.ref_tmp.px, r->px, r->w * r->h);
+    bench.pixels += VL_T4_BenchRefCopy(r, &bench.ref_tmp, op->x, op->y, op->sx, op->sy, op->w, op->h);
+    VL_T4_BENCH_TIME(bench.vl->surfaceToSelf(bench.surf, op->x, op->y, op->sx, op->sy, op->w, op->h));
+}
+
+//x and y are the scroll amounts
+static void VL_T4_BenchScroll(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    *op = {VL_T4_BenchRange(-16, 16), VL_T4_BenchRange(-16, 16), 0, 0, 0, 0, 0};
+    int w = r->w - CK_Cross_max(op->x, -op->x), h = r->h - CK_Cross_max(op->y, -op->y);
+    memcpy(bench.ref_tmp.px, r->px, r->w * r->h);
+    bench.pixels += VL_T4_BenchRefCopy(r, &bench.ref_tmp, CK_Cross_max(-op->x, 0), CK_Cross_max(-op->y, 0),
+                                       CK_Cross_max(op->x, 0), CK_Cross_max(op->y, 0), w, h);
+    VL_T4_BENCH_TIME(bench.vl->scrollSurface(bench.surf, op->x, op->y));
+}
+
+//The blitters are checked against omnispeak's PAL8 versions. sx holds the mapmask or colour.
+static void VL_T4_BenchUnmasked(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_INSIDE);
+    bench.pixels += op->w * op->h;
+    VL_T4_BENCH_TIME_REF(VL_UnmaskedToPAL8((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h));
+    VL_T4_BENCH_TIME(bench.vl->unmaskedToSurface((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h));
+}
+
+static void VL_T4_BenchUnmaskedPM(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_INSIDE);
+    op->sx = VL_T4_BenchRand(16);
+    bench.pixels += op->w * op->h;
+    VL_T4_BENCH_TIME_REF(VL_UnmaskedToPAL8_PM((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h, op->sx));
+    VL_T4_BENCH_TIME(bench.vl->unmaskedToSurface_PM((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h, op->sx));
+}
+
+static void VL_T4_BenchMasked(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_INSIDE);
+    bench.pixels += op->w * op->h;
+    VL_T4_BENCH_TIME_REF(VL_MaskedToPAL8((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h));
+    VL_T4_BENCH_TIME(bench.vl->maskedToSurface((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h));
+}
+
+static void VL_T4_BenchMaskedBlit(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_RIGHT_BOTTOM);
+    bench.pixels += VL_T4_BenchClippedArea(op);
+    VL_T4_BENCH_TIME_REF(VL_MaskedBlitClipToPAL8((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h, r->w, r->h));
+    VL_T4_BENCH_TIME(bench.vl->maskedBlitToSurface((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h));
+}
+
+static void VL_T4_BenchBit(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_INSIDE);
+    op->sx = VL_T4_BenchRand(16);
+    bench.pixels += op->w * op->h;
+    VL_T4_BENCH_TIME_REF(VL_1bppToPAL8((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h, op->sx));
+    VL_T4_BENCH_TIME(bench.vl->bitToSurface((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h, op->sx));
+}
+
+//sx is the colour and sy the mapmask
+static void VL_T4_BenchBitPM(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_INSIDE);
+    op->sx = VL_T4_BenchRand(16);
+    op->sy = VL_T4_BenchRand(16);
+    bench.pixels += op->w * op->h;
+    VL_T4_BENCH_TIME_REF(VL_1bppToPAL8_PM((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h, op->sx, op->sy));
+    VL_T4_BENCH_TIME(bench.vl->bitToSurface_PM((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h, op->sx, op->sy));
+}
+
+static void VL_T4_BenchBitXor(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_INSIDE);
+    op->sx = VL_T4_BenchRand(16);
+    bench.pixels += op->w * op->h;
+    VL_T4_BENCH_TIME_REF(VL_1bppXorWithPAL8((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h, op->sx));
+    VL_T4_BENCH_TIME(bench.vl->bitXorWithSurface((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h, op->sx));
+}
+
+static void VL_T4_BenchBitBlit(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_INSIDE);
+    op->sx = VL_T4_BenchRand(16);
+    bench.pixels += op->w * op->h;
+    VL_T4_BENCH_TIME_REF(VL_1bppBlitToPAL8((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h, op->sx));
+    VL_T4_BENCH_TIME(bench.vl->bitBlitToSurface((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h, op->sx));
+}
+
+static void VL_T4_BenchBitInvBlit(VL_T4_BenchOp *op)
+{
+    VL_T4_BenchRef *r = &bench.ref;
+    VL_T4_BenchGraphic(op, VL_T4_BENCH_RIGHT_BOTTOM);
+    op->sx = VL_T4_BenchRand(16);
+    bench.pixels += VL_T4_BenchClippedArea(op);
+    VL_T4_BENCH_TIME_REF(VL_1bppInvBlitClipToPAL8((void *)bench.src, r->px, op->x, op->y, r->w, op->w, op->h, r->w, r->h, op->sx));
+    VL_T4_BENCH_TIME(bench.vl->bitInvBlitToSurface((void *)bench.src, bench.surf, op->x, op->y, op->w, op->h, op->sx));
+}
+
+static const VL_T4_BenchTest bench_tests[] = {
+    {"surfaceRect", VL_T4_BenchRect},
+    {"surfaceRect_PM", VL_T4_BenchRectPM},
+    {"surfaceToSurface", VL_T4_BenchToSurface},
+    {"surfaceToSelf", VL_T4_BenchToSelf},
+    {"scrollSurface", VL_T4_BenchScroll},
+    {"unmaskedToSurface", VL_T4_BenchUnmasked},
+    {"unmaskedToSurface_PM", VL_T4_BenchUnmaskedPM},
+    {"maskedToSurface", VL_T4_BenchMasked},
+    {"maskedBlitToSurface", VL_T4_BenchMaskedBlit},
+    {"bitToSurface", VL_T4_BenchBit},
+    {"bitToSurface_PM", VL_T4_BenchBitPM},
+    {"bitXorWithSurface", VL_T4_BenchBitXor},
+    {"bitBlitToSurface", VL_T4_BenchBitBlit},
+    {"bitInvBlitToSurface", VL_T4_BenchBitInvBlit},
+};
+
+static void VL_T4_BenchReport(const char *name, uint32_t cycles, uint32_t ref_cycles, uint32_t pixels)
+{
+    //Hundredths of a cycle and of a nanosecond
+    uint32_t centi_cycles = pixels ? (uint64_t)cycles * 100 / pixels : 0;
+    uint32_t centi_ns = (uint64_t)centi_cycles * 1000 / (F_CPU_ACTUAL / 1000000);
+    printf("VL: %-20s %8lu px %5lu.%02lu cycles/px %5lu.%02lu ns/px", name, pixels, centi_cycles / 100,
+           centi_cycles % 100, centi_ns / 100, centi_ns % 100);
+    if (ref_cycles)
+    {
+        uint32_t centi_ref = pixels ? (uint64_t)ref_cycles * 100 / pixels : 0;
+        printf(", direct PAL8 %lu.%02lu cycles/px", centi_ref / 100, centi_ref % 100);
+    }
+    printf("\n");
+}
+
+static bool VL_T4_BenchCompare(const char *name, void *surface, const VL_T4_BenchRef *r, int last_op)
+{
+    for (int y = 0; y < r->h; y++)
+    {
+        for (int x = 0; x < r->w; x++)
+        {
+            int got = bench.vl->surfacePGet(surface, x, y);
+            int want = r->px[y * r->w + x];
+            if (got == want)
+            {
+                continue;
+            }
+            printf("VL: %-20s FAIL on %dx%d %s at %d,%d: got %d, expected %d. Calls since the last check:\n", name,
+                   r->w, r->h, (surface == bench.surf) ? "destination" : "source", x, y, got, want);
+            for (int i = last_op - last_op % CHECK_EVERY; i <= last_op; i++)
+            {
+                VL_T4_BenchOp *op = &bench.window[i % CHECK_EVERY];
+                printf("VL:   #%d x %d y %d w %d h %d sx %d sy %d arg %d\n", i, op->x, op->y, op->w, op->h, op->sx,
+                       op->sy, op->arg);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool VL_T4_BenchRun(const VL_T4_BenchTest *test)
+{
+    VL_T4_BenchRandomise(bench.surf, &bench.ref);
+    VL_T4_BenchRandomise(bench.other, &bench.ref_other);
+    for (int i = 0; i < GFX_SLOTS; i++)
+    {
+        bench.gfx[i].w = 0;
+    }
+    bench.cycles = 0;
+    bench.ref_cycles = 0;
+    bench.pixels = 0;
+
+    for (int i = 0; i < VL_T4_BENCH_OPS; i++)
+    {
+        test->run(&bench.window[i % CHECK_EVERY]);
+        if ((i + 1) % CHECK_EVERY != 0 && i != VL_T4_BENCH_OPS - 1)
+        {
+            continue;
+        }
+        //Deferred draws are only applied when the surface is read, so that is timed too
+        VL_T4_BENCH_TIME(bench.vl->surfacePGet(bench.surf, 0, 0));
+        if (!VL_T4_BenchCompare(test->name, bench.surf, &bench.ref, i) ||
+            !VL_T4_BenchCompare(test->name, bench.other, &bench.ref_other, i))
+        {
+            return false;
+        }
+    }
+    VL_T4_BenchReport(test->name, bench.cycles, bench.ref_cycles, bench.pixels);
+    return true;
+}
+
+//CreateSurface never returns if it runs out of memory, so check there is room first
+static void *VL_T4_BenchCreate(int w, int h)
+{
+    void *probe = malloc(w * h);
+    if (probe != NULL)
+    {
+        free(probe);
+    }
+    else if ((probe = extmem_malloc(w * h)) != NULL)
+    {
+        extmem_free(probe);
+    }
+    else
+    {
+        printf("VL: Not enough memory for a %dx%d test surface\n", w, h);
+        return NULL;
+    }
+    return bench.vl->createSurface(w, h, VL_SurfaceUsage_Default);
+}
+
+//Only timed. The output goes to the display, so it can't be read back.
+FLASHMEM static void VL_T4_BenchPresent()
+{
+    void *screen = VL_T4_BenchCreate(336, 224);
+    if (screen == NULL)
+    {
+        return;
+    }
+    for (int y = 0; y < 224; y++)
+    {
+        for (int x = 0; x < 336; x += 8)
+        {
+            bench.vl->surfaceRect(screen, x, y, 8, 1, VL_T4_BenchRand(16));
+        }
+    }
+    bench.cycles = 0;
+    for (int i = 0; i < PRESENT_FRAMES; i++)
+    {
+        VL_T4_BENCH_TIME(bench.vl->present(screen, VL_T4_BenchRand(16), VL_T4_BenchRand(24), false));
+    }
+    VL_T4_BenchReport("present", bench.cycles, 0, PRESENT_FRAMES * 320 * 200);
+    bench.vl->destroySurface(screen);
+}
+
+FLASHMEM static void VL_T4_Bench()
+{
+    bench.vl = VL_Impl_GetBackend();
+    bench.seed = ARM_DWT_CYCCNT | 1;
+    printf("VL: Testing the backend, seed 0x%08lx, %d calls per primitive\n", bench.seed, VL_T4_BENCH_OPS);
+
+    int passed = 0, total = 0;
+    for (unsigned s = 0; s < sizeof(SURFACE_SIZES) / sizeof(SURFACE_SIZES[0]); s++)
+    {
+        int w = SURFACE_SIZES[s][0], h = SURFACE_SIZES[s][1];
+        uint8_t *mem = (uint8_t *)malloc(w * h * 3 + GFX_SLOTS * GFX_SLOT_BYTES);
+        bench.surf = mem ? VL_T4_BenchCreate(w, h) : NULL;
+        bench.other = bench.surf ? VL_T4_BenchCreate(w, h) : NULL;
+        if (bench.other == NULL)
+        {
+            printf("VL: Skipping %dx%d surfaces, out of memory\n", w, h);
+            bench.vl->destroySurface(bench.surf);
+            free(mem);
+            continue;
+        }
+
+        bench.ref = {w, h, mem};
+        bench.ref_other = {w, h, mem + w * h};
+        bench.ref_tmp = {w, h, mem + w * h * 2};
+        for (int i = 0; i < GFX_SLOTS; i++)
+        {
+            bench.gfx[i].data = mem + w * h * 3 + i * GFX_SLOT_BYTES;
+        }
+
+        printf("VL: %dx%d surfaces\n", w, h);
+        for (unsigned t = 0; t < sizeof(bench_tests) / sizeof(bench_tests[0]); t++)
+        {
+            passed += VL_T4_BenchRun(&bench_tests[t]);
+            total++;
+        }
+        bench.vl->destroySurface(bench.other);
+        bench.vl->destroySurface(bench.surf);
+        free(mem);
+    }
+
+    VL_T4_BenchPresent();
+    printf("VL: %d of %d passed\n", passed, total);
+}
+#endif
+
+FLASHMEM void VL_T4_BenchStartup()
+{
+#if VL_T4_BENCH
+    CON_T4_Register('b', "Test and benchmark the video backend", VL_T4_Bench);
+#endif
+}
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_VL_T4_BENCH_H
+#define ID_VL_T4_BENCH_H
+
+//Differential test and benchmark of every vl_t4_backend primitive, run on the Teensy with 'b' on
+//the console. Built in the teensy41_bench environment, which adds -DVL_T4_BENCH=1.
+//
+//Each primitive is called with random sizes, positions and clip cases on surfaces created by the
+//backend, and the same operation is applied to a plain one byte per pixel copy. The blitters use
+//omnispeak's own PAL8 routines as the reference. Every few calls the backend surface is read back
+//with surfacePGet and compared, so packed, deferred and copy-on-write surfaces are all checked
+//in whichever mode the build is using. Cycles per pixel are reported for the backend calls, and for
+//the blitters also for omnispeak's direct PAL8 conversion, to show what the expanded graphics cache
+//saves. A quarter of the blits use a new graphic, so the cached figures include misses.
+
+#ifndef VL_T4_BENCH
+#define VL_T4_BENCH 0
+#endif
+
+//Random calls made to each primitive
+#ifndef VL_T4_BENCH_OPS
+#define VL_T4_BENCH_OPS 256
+#endif
+
+void VL_T4_BenchStartup();
+
+#endif
@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <Arduino.h>
+#include "id_vl_t4_cache.h"
+#include "id_con_t4.h"
+#include "id_mem_t4.h"
+#include "id_log_t4.h"
+
+extern "C"
+{
+#include "printf.h"
+#include "id_vl.h"
+#include "id_vl_private.h"
+#include "ck_cross.h"
+extern uint8_t external_psram_size;
+}
+
+//Expanded graphics live in PSRAM. Least recently used entries are evicted to stay within the budget.
+#ifndef VL_T4_GFXCACHE_BUDGET
+#define VL_T4_GFXCACHE_BUDGET (1024 * 1024)
+#endif
+//Entries are keyed by the source address and draw, without looking at the source data, so a hit costs no more
+//than a bucket walk. Graphics chunks can be purged and another one loaded at the same address, so the memory
+//hooks call VL_T4_GfxCacheInvalidate whenever memory is freed or handed out again.
+static const int MAX_ENTRIES = 2048;
+static const int NUM_BUCKETS = 512;
+static const int MAX_PIXELS = 128 * 128; //Larger graphics, such as full screen pictures, are drawn directly
+
+typedef struct VL_T4_GfxEntry
+{
+    const void *src;
+    uint16_t w, h;
+    uint8_t op, param;
+    bool has_mask;
+    int16_t next; //Next in bucket, or in the free list
+    int16_t lru_prev, lru_next;
+    uint8_t *data; //Colour plane, followed by the mask plane if has_mask
+} VL_T4_GfxEntry;
+
+typedef struct VL_T4_GfxCacheStats
+{
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t invalidated; //Dropped because their source memory was freed or reused
+    uint32_t evictions;
+    uint32_t bypassed; //Not cacheable, too big, or no PSRAM
+} VL_T4_GfxCacheStats;
+
+static bool cache_enabled = false;
+//The entries are read on every lookup, so they are kept out of PSRAM. Only the expanded pixels live there.
+static DMAMEM VL_T4_GfxEntry entries[MAX_ENTRIES];
+EXTMEM static uint8_t scratch[2][MAX_PIXELS];
+static int16_t buckets[NUM_BUCKETS];
+static int16_t lru_head = -1, lru_tail = -1; //Head is the most recently used
+static int16_t free_head = -1;
+static uint32_t bytes_used = 0;
+static uintptr_t src_lo = UINTPTR_MAX, src_hi = 0; //Bounds of every cached source, to skip most invalidations
+static VL_T4_GfxCacheStats stats;
+
+//Run the draw at 0,0 into a buffer with a pitch of the graphic's width
+static void VL_T4_RunDraw(const VL_T4_GfxDraw *d, uint8_t *dest)
+{
+    switch (d->op)
+    {
+    case VL_T4_GFX_UNMASKED:
+        VL_UnmaskedToPAL8(d->src, dest, 0, 0, d->w, d->w, d->h);
+        break;
+    case VL_T4_GFX_UNMASKED_PM:
+        VL_UnmaskedToPAL8_PM(d->src, dest, 0, 0, d->w, d->w, d->h, d->mapmask);
+        break;
+    case VL_T4_GFX_MASKED:
+        VL_MaskedToPAL8(d->src, dest, 0, 0, d->w, d->w, d->h);
+        break;
+    case VL_T4_GFX_MASKED_CLIP:
+        VL_MaskedBlitClipToPAL8(d->src, dest, 0, 0, d->w, d->w, d->h, d->w, d->h);
+        break;
+    case VL_T4_GFX_BIT:
+        VL_1bppToPAL8(d->src, dest, 0, 0, d->w, d->w, d->h, d->colour);
+        break;
+    case VL_T4_GFX_BIT_PM:
+        VL_1bppToPAL8_PM(d->src, dest, 0, 0, d->w, d->w, d->h, d->colour, d->mapmask);
+        break;
+    case VL_T4_GFX_BIT_XOR:
+        VL_1bppXorWithPAL8(d->src, dest, 0, 0, d->w, d->w, d->h, d->colour);
+        break;
+    case VL_T4_GFX_BIT_BLIT:
+        VL_1bppBlitToPAL8(d->src, dest, 0, 0, d->w, d->w, d->h, d->colour);
+        break;
+    case VL_T4_GFX_BIT_INVBLIT:
+        VL_1bppInvBlitClipToPAL8(d->src, dest, 0, 0, d->w, d->w, d->h, d->w, d->h, d->colour);
+        break;
+    }
+}
+
+static int VL_T4_Bucket(const void *src, int w, int h, int op, int param)
+{
+    uint32_t key = ((uint32_t)src >> 2) ^ (w << 16) ^ h ^ (op << 24) ^ (param << 28);
+    return (key * 2654435761u) >> 23; //Top 9 bits, NUM_BUCKETS
+}
+
+static void VL_T4_LruUnlink(int i)
+{
+    VL_T4_GfxEntry *e = &entries[i];
+    if (e->lru_prev >= 0)
+        entries[e->lru_prev].lru_next = e->lru_next;
+    else
+        lru_head = e->lru_next;
+    if (e->lru_next >= 0)
+        entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        lru_tail = e->lru_prev;
+}
+
+static void VL_T4_LruPushFront(int i)
+{
+    VL_T4_GfxEntry *e = &entries[i];
+    e->lru_prev = -1;
+    e->lru_next = lru_head;
+    if (lru_head >= 0)
+        entries[lru_head].lru_prev = i;
+    lru_head = i;
+    if (lru_tail < 0)
+        lru_tail = i;
+}
+
+static uint32_t VL_T4_EntrySize(VL_T4_GfxEntry *e)
+{
+    return e->w * e->h * (e->has_mask ? 2 : 1);
+}
+
+static void VL_T4_RemoveEntry(int i)
+{
+    VL_T4_GfxEntry *e = &entries[i];
+    int16_t *link = &buckets[VL_T4_Bucket(e->src, e->w, e->h, e->op, e->param)];
+    while (*link != i)
+    {
+        link = &entries[*link].next;
+    }
+    *link = e->next;
+    VL_T4_LruUnlink(i);
+
+    bytes_used -= VL_T4_EntrySize(e);
+    MEM_T4_TrackFree(e->data);
+    extmem_free(e->data);
+    e->next = free_head;
+    free_head = i;
+}
+
+bool VL_T4_Expand(const VL_T4_GfxDraw *draw, uint8_t *colour, uint8_t *mask)
+{
+    int size = draw->w * draw->h;
+    memset(colour, 0x00, size);
+    VL_T4_RunDraw(draw, colour);
+    memset(mask, 0xFF, size);
+    VL_T4_RunDraw(draw, mask);
+
+    //Bits that differ between the two passes came from the destination
+    uint8_t any = 0;
+    for (int i = 0; i < size; i++)
+    {
+        mask[i] ^= colour[i];
+        any |= mask[i];
+    }
+    return any != 0;
+}
+
+bool VL_T4_GfxCacheLookup(const void *src, int w, int h, VL_T4_GfxOp op, int param, VL_T4_Expanded *out)
+{
+    //Plane masked draws would need an entry per map mask, and miss too often to pay for expanding them twice
+    if (!cache_enabled || op > VL_T4_GFX_MASKED_CLIP || w <= 0 || h <= 0 || w * h > MAX_PIXELS)
+    {
+        stats.bypassed++;
+        return false;
+    }
+
+    int bucket = VL_T4_Bucket(src, w, h, op, param);
+
+    for (int i = buckets[bucket]; i >= 0; i = entries[i].next)
+    {
+        VL_T4_GfxEntry *e = &entries[i];
+        if (e->src != src || e->w != w || e->h != h || e->op != op || e->param != param)
+        {
+            continue;
+        }
+
+        stats.hits++;
+        VL_T4_LruUnlink(i);
+        VL_T4_LruPushFront(i);
+        out->w = w;
+        out->h = h;
+        out->colour = e->data;
+        out->mask = e->has_mask ? e->data + w * h : NULL;
+        return true;
+    }
+
+    //Miss, expand it into scratch then find room for it
+    stats.misses++;
+    VL_T4_GfxDraw draw = {op, (void *)src, w, h, 0, param};
+    bool has_mask = VL_T4_Expand(&draw, scratch[0], scratch[1]);
+    uint32_t size = w * h * (has_mask ? 2 : 1);
+    while (lru_tail >= 0 && (free_head < 0 || bytes_used + size > VL_T4_GFXCACHE_BUDGET))
+    {
+        stats.evictions++;
+        VL_T4_RemoveEntry(lru_tail);
+    }
+
+    uint8_t *data = (uint8_t *)extmem_malloc(size);
+    if (data == NULL || free_head < 0)
+    {
+        extmem_free(data);
+        stats.bypassed++;
+        return false;
+    }
+    MEM_T4_TrackAlloc(data, size, MEM_T4_TAG_CACHE);
+    memcpy(data, scratch[0], w * h);
+    if (has_mask)
+    {
+        memcpy(data + w * h, scratch[1], w * h);
+    }
+
+    int i = free_head;
+    VL_T4_GfxEntry *e = &entries[i];
+    free_head = e->next;
+    e->src = src;
+    e->w = w;
+    e->h = h;
+    e->op = op;
+    e->param = param;
+    e->has_mask = has_mask;
+    e->data = data;
+    e->next = buckets[bucket];
+    buckets[bucket] = i;
+    VL_T4_LruPushFront(i);
+    bytes_used += size;
+    src_lo = CK_Cross_min(src_lo, (uintptr_t)src);
+    src_hi = CK_Cross_max(src_hi, (uintptr_t)src + 1);
+
+    out->w = w;
+    out->h = h;
+    out->colour = data;
+    out->mask = has_mask ? data + w * h : NULL;
+    return true;
+}
+
+void VL_T4_GfxCacheInvalidate(const void *start, size_t size)
+{
+    uintptr_t lo = (uintptr_t)start, hi = lo + size;
+    if (hi <= src_lo || lo >= src_hi)
+    {
+        return;
+    }
+    for (int i = lru_head; i >= 0;)
+    {
+        int next = entries[i].lru_next;
+        uintptr_t src = (uintptr_t)entries[i].src;
+        if (src >= lo && src < hi)
+        {
+            stats.invalidated++;
+            VL_T4_RemoveEntry(i);
+        }
+        i = next;
+    }
+    if (lru_head < 0)
+    {
+        src_lo = UINTPTR_MAX;
+        src_hi = 0;
+    }
+}
+
+void VL_T4_GfxCachePrintStats()
+{
+    uint32_t lookups = CK_Cross_max(1, stats.hits + stats.misses);
+    printf("GFX: %lu hits, %lu misses (%lu%% hit rate), %lu invalidated, %lu evictions, %lu bypassed\n",
+           stats.hits, stats.misses, stats.hits * 100 / lookups, stats.invalidated, stats.evictions, stats.bypassed);
+    printf("GFX: %lu/%lu bytes used\n", bytes_used, (uint32_t)VL_T4_GFXCACHE_BUDGET);
+}
+
+FLASHMEM void VL_T4_GfxCacheStartup()
+{
+    CON_T4_Register('g', "Graphics cache hit/miss counters", VL_T4_GfxCachePrintStats);
+    if (external_psram_size == 0)
+    {
+        LOG_T4_WARN("GFX: No PSRAM, graphics cache disabled\n");
+        return;
+    }
+
+    //DMAMEM isn't zeroed at startup, so build the free list by hand
+    for (int i = 0; i < MAX_ENTRIES; i++)
+    {
+        entries[i].next = (i + 1 < MAX_ENTRIES) ? i + 1 : -1;
+    }
+    free_head = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++)
+    {
+        buckets[i] = -1;
+    }
+    cache_enabled = true;
+}
@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-2.0
+#ifndef ID_VL_T4_CACHE_H
+#define ID_VL_T4_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Cache of EGA planar graphics already expanded to 8 bit indexed pixels.
+//
+//Each cached graphic is stored as a colour plane and an optional mask plane, and is drawn with
+//dest = (dest & mask) ^ colour. That covers every PAL8 draw routine: opaque pixels have a zero
+//mask, transparent pixels have a 0xFF mask and zero colour, and plane masked writes fall in between.
+//Entries are created by running the original routine twice, over a background of 0x00 then 0xFF,
+//so cached draws are bit exact with uncached ones. They are found by the source address alone, so
+//memory that held graphics has to be invalidated before it is reused.
+
+typedef enum VL_T4_GfxOp
+{
+    VL_T4_GFX_UNMASKED,    //VL_UnmaskedToPAL8
+    VL_T4_GFX_MASKED,      //VL_MaskedToPAL8
+    VL_T4_GFX_MASKED_CLIP, //VL_MaskedBlitClipToPAL8
+    //Plane masked and 1bpp graphics are not cached, but can still be expanded with VL_T4_Expand
+    VL_T4_GFX_UNMASKED_PM, //VL_UnmaskedToPAL8_PM
+    VL_T4_GFX_BIT,         //VL_1bppToPAL8
+    VL_T4_GFX_BIT_PM,      //VL_1bppToPAL8_PM
+    VL_T4_GFX_BIT_XOR,     //VL_1bppXorWithPAL8
+    VL_T4_GFX_BIT_BLIT,    //VL_1bppBlitToPAL8
+    VL_T4_GFX_BIT_INVBLIT, //VL_1bppInvBlitClipToPAL8
+} VL_T4_GfxOp;
+
+//Everything needed to run one of the PAL8 draw routines
+typedef struct VL_T4_GfxDraw
+{
+    VL_T4_GfxOp op;
+    void *src;
+    int w, h;
+    int colour;
+    int mapmask;
+} VL_T4_GfxDraw;
+
+typedef struct VL_T4_Expanded
+{
+    int w, h;
+    const uint8_t *colour;
+    const uint8_t *mask; //NULL if every pixel is opaque
+} VL_T4_Expanded;
+
+void VL_T4_GfxCacheStartup();
+//Find or create the expanded version of a graphic. Returns false if it can't be cached, in which
+//case the caller should draw it directly. The result is valid until the next lookup.
+bool VL_T4_GfxCacheLookup(const void *src, int w, int h, VL_T4_GfxOp op, int param, VL_T4_Expanded *out);
+//Expand a graphic into caller provided buffers of w * h bytes each, without caching it.
+//Returns false if every pixel is opaque, in which case mask is all zero.
+bool VL_T4_Expand(const VL_T4_GfxDraw *draw, uint8_t *colour, uint8_t *mask);
+//Drop every entry whose source lies in [start, start + size). Cheap when none can.
+void VL_T4_GfxCacheInvalidate(const void *start, size_t size);
+void VL_T4_GfxCachePrintStats();
+
+#endif
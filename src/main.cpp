@@ -1,6 +1,15 @@
 //Copyright 2020, Ryan Wendland
 //SPDX-License-Identifier: GPL-2.0
 #include <Arduino.h>
+#include "id_mem_t4.h"
+#include "id_vl_t4.h"
+#include "id_sd_t4.h"
+#include "id_in_t4.h"
+#include "id_log_t4.h"
+#include "id_prof_t4.h"
+#include "id_rec_t4.h"
+#include "id_vl_t4_bench.h"
+#include "id_cap_t4.h"
 extern "C"
 {
 #include "printf.h"
@@ -13,20 +22,69 @@ void CK_InitGame();
 void CK_DemoLoop();
 }
 
+//Plain printf output, such as console reports, is queued behind the log messages. It only waits
+//if the Serial1 transmit ring is full, and is never dropped.
 void _putchar(char character)
 {
     Serial1.write(character);
-    Serial1.flush();
+}
+
+//Boot is run as a list of stages, ordered so that anything which can run in the background
+//(OPL reset pulse, USB enumeration, the splash frame DMA) is started before the stages that block.
+typedef struct BootStage
+{
+    const char *name;
+    void (*run)();
+    uint32_t us;
+} BootStage;
+
+static BootStage boot_stages[] = {
+    {"opl reset", SD_T4_BeginReset},
+    {"usb host", IN_T4_BeginEnumeration},
+    {"display", VL_T4_Startup},
+    {"splash", VL_T4_ShowSplash},
+    {"sd mount", FS_Startup},
+    {"recorder", REC_T4_SaveDump},
+    {"mm", MM_Startup},
+    {"cfg", CFG_Startup},
+    {"opl ready", SD_T4_EndReset},
+};
+
+static void RunBootStages()
+{
+    uint32_t boot_start = micros();
+    uint32_t first_frame = 0;
+    for (BootStage &stage : boot_stages)
+    {
+        uint32_t start = micros();
+        stage.run();
+        stage.us = micros() - start;
+        if (stage.run == VL_T4_ShowSplash)
+        {
+            first_frame = micros() - boot_start;
+        }
+    }
+
+    //Report at the end so printing doesn't slow boot down
+    for (BootStage &stage : boot_stages)
+    {
+        LOG_T4_INFO("BOOT: %-10s %7lu us\n", stage.name, stage.us);
+    }
+    LOG_T4_INFO("BOOT: first frame at %lu us, total %lu us\n", first_frame, micros() - boot_start);
 }
 
 CK_EpisodeDef *ck_currentEpisode;
 void setup()
 {
     Serial1.begin(115200);
+    LOG_T4_Startup();
+    PROF_T4_Startup();
+    REC_T4_Startup();
+    VL_T4_BenchStartup();
+    CAP_T4_Startup();
+    MEM_T4_Startup();
 
-    FS_Startup();
-    MM_Startup();
-    CFG_Startup();
+    RunBootStages();
 
 #ifdef EP4
     ck_currentEpisode = &ck4_episode;
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+"""Decodes a frame capture from src/id_cap_t4.cpp.
+
+Usage: t4cap.py <T4CAP.BIN or USB serial capture> [--crc] [--ppm <dir>] [--rgb <file>]
+
+Prints each captured frame with its checksum. A USB serial capture can start part way through, in
+which case decoding starts at the first keyframe.
+
+  --crc         Only print the frame number and CRC of each frame, so two captures can be diffed
+  --ppm <dir>   Write each captured frame to <dir> as a PPM image
+  --rgb <file>  Write raw 320x200 RGB24 video with one frame per present. Skipped frames repeat the
+                last captured one. Convert with:
+                ffmpeg -f rawvideo -pixel_format rgb24 -video_size 320x200 -framerate 35 -i <file> out.mp4
+"""
+
+import os
+import struct
+import sys
+import zlib
+
+STREAM_MAGIC = 0x50433454
+FRAME_MAGIC = 0x52463454
+VERSION = 1
+KEYFRAME = 0x01
+STREAM_HEADER = struct.Struct("<IHHHHI")
+FRAME_HEADER = struct.Struct("<IIIII16HB3x")
+WIDTH = 320
+HEIGHT = 200
+FRAME_BYTES = WIDTH * HEIGHT // 2
+
+
+def rle_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        c = data[i]
+        i += 1
+        if c < 0x80:
+            out += data[i:i + c + 1]
+            i += c + 1
+        elif c < 0xFF:
+            out += bytes([data[i]]) * (c - 0x7D)
+            i += 1
+        else:
+            out += bytes(data[i] | (data[i + 1] << 8))
+            i += 2
+    return out
+
+
+def rgb_palette(palette):
+    rgb = []
+    for c in palette:
+        r, g, b = (c >> 11) & 0x1F, (c >> 5) & 0x3F, c & 0x1F
+        rgb.append(bytes(((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2))))
+    return rgb
+
+
+def to_rgb(frame, palette):
+    rgb = rgb_palette(palette)
+    # Two pixels a byte, the left one in the low nibble
+    pairs = [rgb[i & 0xF] + rgb[i >> 4] for i in range(256)]
+    return b"".join(pairs[b] for b in frame)
+
+
+def frames(data):
+    """Yields (header fields, decoded frame or None, crc ok)."""
+    pos = 0
+    if len(data) >= STREAM_HEADER.size and struct.unpack_from("<I", data)[0] == STREAM_MAGIC:
+        magic, version, width, height, _, _ = STREAM_HEADER.unpack_from(data)
+        if version != VERSION or width != WIDTH or height != HEIGHT:
+            sys.exit("Unsupported capture (version %d, %dx%d)" % (version, width, height))
+        pos = STREAM_HEADER.size
+
+    last = None
+    magic_bytes = struct.pack("<I", FRAME_MAGIC)
+    while True:
+        pos = data.find(magic_bytes, pos)
+        if pos < 0 or pos + FRAME_HEADER.size > len(data):
+            return
+        fields = FRAME_HEADER.unpack_from(data, pos)
+        _, number, ms, crc, size = fields[:5]
+        palette, flags = fields[5:21], fields[21]
+        start = pos + FRAME_HEADER.size
+        if start + size > len(data):
+            return
+        try:
+            delta = rle_decode(data[start:start + size])
+        except IndexError:
+            delta = b""
+        if len(delta) != FRAME_BYTES:
+            # Not a real frame header, or damaged. Look for the next one.
+            pos += 1
+            last = None
+            continue
+        pos = start + size
+
+        if flags & KEYFRAME:
+            frame = bytes(delta)
+        elif last is not None:
+            frame = bytes(a ^ b for a, b in zip(last, delta))
+        else:
+            # Waiting for a keyframe
+            yield number, ms, crc, palette, flags, None, False
+            continue
+        ok = (zlib.crc32(frame) & 0xFFFFFFFF) == crc
+        last = frame if ok else None
+        yield number, ms, crc, palette, flags, frame, ok
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write(__doc__)
+        return 1
+    args = sys.argv[2:]
+    crc_only = "--crc" in args
+    ppm_dir = args[args.index("--ppm") + 1] if "--ppm" in args else None
+    rgb_path = args[args.index("--rgb") + 1] if "--rgb" in args else None
+    with open(sys.argv[1], "rb") as f:
+        data = f.read()
+
+    if ppm_dir:
+        os.makedirs(ppm_dir, exist_ok=True)
+    rgb_out = open(rgb_path, "wb") if rgb_path else None
+    decoded = bad = waiting = 0
+    last_number = None
+    last_rgb = None
+    for number, ms, crc, palette, flags, frame, ok in frames(data):
+        if frame is None:
+            waiting += 1
+            continue
+        if not ok:
+            bad += 1
+            print("frame %6d  %9.3f s  crc %08x  BAD" % (number, ms / 1000.0, crc))
+            continue
+        decoded += 1
+        if crc_only:
+            print("%d %08x" % (number, crc))
+        else:
+            print("frame %6d  %9.3f s  crc %08x%s" % (number, ms / 1000.0, crc, "  keyframe" if flags & KEYFRAME else ""))
+
+        rgb = to_rgb(frame, palette) if (ppm_dir or rgb_out) else None
+        if ppm_dir:
+            with open(os.path.join(ppm_dir, "frame%06d.ppm" % number), "wb") as f:
+                f.write(b"P6 %d %d 255\n" % (WIDTH, HEIGHT))
+                f.write(rgb)
+        if rgb_out:
+            if last_number is not None and last_rgb is not None:
+                for _ in range(number - last_number - 1):
+                    rgb_out.write(last_rgb)
+            rgb_out.write(rgb)
+            last_rgb = rgb
+        last_number = number
+
+    if rgb_out:
+        rgb_out.close()
+    if not crc_only:
+        print("%d frames decoded, %d failed their checksum, %d waiting for a keyframe" % (decoded, bad, waiting))
+    return 1 if bad else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+"""Decodes a Serial1 capture from a build with -DLOG_T4_BINARY=1.
+
+Binary log records only hold the address of their format string and the raw arguments, so the
+firmware ELF the capture came from is needed to turn them back into text. String arguments are
+copied into the record. Anything between
+records, such as console output, is passed through unchanged.
+
+Usage: t4log.py <firmware.elf> <capture.bin>
+The ELF is at .pio/build/teensy41/firmware.elf after a PlatformIO build.
+"""
+
+import re
+import struct
+import sys
+
+RECORD_SYNC = 0x1E
+MAX_ARGS = 24
+LEVELS = " EWID"
+CONVERSION = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?(hh|h|ll|l|z|j|t)?([diouxXcspfFeEgG%])")
+
+
+class Elf:
+    """Just enough of ELF32 to read bytes at a load address."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1:
+            raise ValueError("%s is not a 32 bit ELF file" % path)
+        shoff, = struct.unpack_from("<I", self.data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", self.data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, _, addr, offset, size = struct.unpack_from("<IIIIII", self.data, shoff + i * shentsize)
+            if sh_type == 1 and addr != 0:  # SHT_PROGBITS
+                self.sections.append((addr, offset, size))
+
+    def string(self, addr):
+        for base, offset, size in self.sections:
+            if base <= addr < base + size:
+                start = offset + addr - base
+                end = self.data.find(b"\0", start, offset + size)
+                return self.data[start:end].decode("latin-1")
+        return None
+
+
+def signed(word):
+    return word - (1 << 32) if word & 0x80000000 else word
+
+
+def format_record(elf, fmt_addr, words):
+    fmt = elf.string(fmt_addr)
+    if fmt is None:
+        return "<unknown format 0x%08x> %s\n" % (fmt_addr, " ".join("0x%08x" % w for w in words))
+    words = list(words)
+
+    def take():
+        return words.pop(0)
+
+    def convert(m):
+        try:
+            return convert_one(m)
+        except IndexError:
+            # Arguments past LOG_T4_RECORD_MAX_ARGS aren't sent
+            return "?"
+
+    def convert_one(m):
+        flags, width, precision, length, conv = m.groups()
+        if conv == "%":
+            return "%"
+        if width == "*":
+            width = str(signed(take()))
+        if precision == "*":
+            precision = str(signed(take()))
+        spec = "%" + flags + (width or "") + ("." + precision if precision is not None else "")
+
+        if conv in "fFeEgG":
+            low = take()
+            value = struct.unpack("<d", struct.pack("<II", low, take()))[0]
+            return (spec + conv) % value
+        if length == "ll":
+            value = take()
+            value |= take() << 32
+            if conv in "di" and value & (1 << 63):
+                value -= 1 << 64
+        elif conv == "s":
+            # A length word, then the bytes padded to whole words
+            size = take()
+            raw = b"".join(struct.pack("<I", take()) for _ in range((size + 3) // 4))
+            return (spec + "s") % raw[:size].decode("latin-1")
+        else:
+            value = take()
+            if conv in "di":
+                value = signed(value)
+        if conv == "p":
+            return "0x%08x" % value
+        if conv == "c":
+            return (spec + "c") % chr(value & 0xFF)
+        return (spec + {"u": "d", "i": "d"}.get(conv, conv)) % value
+
+    return CONVERSION.sub(convert, fmt)
+
+
+def decode(elf, capture, out):
+    i = 0
+    while i < len(capture):
+        start = capture.find(bytes([RECORD_SYNC]), i)
+        if start < 0:
+            start = len(capture)
+        out.write(capture[i:start].decode("latin-1"))
+        i = start
+        if i + 12 > len(capture):
+            out.write(capture[i:].decode("latin-1"))
+            break
+
+        level, num_args, checksum = capture[i + 1], capture[i + 2], capture[i + 3]
+        length = 12 + num_args * 4
+        body = capture[i + 4:i + length]
+        if level >= len(LEVELS) or num_args > MAX_ARGS or len(body) != length - 4 or \
+                (level + num_args + sum(body)) & 0xFF != checksum:
+            # Not a record, or a damaged one. Resync on the next byte.
+            out.write("?")
+            i += 1
+            continue
+
+        us, fmt_addr = struct.unpack_from("<II", body)
+        words = struct.unpack_from("<%dI" % num_args, body, 8)
+        out.write("[%10.6f] %s %s" % (us / 1e6, LEVELS[level], format_record(elf, fmt_addr, words)))
+        i += length
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+    elf = Elf(sys.argv[1])
+    with open(sys.argv[2], "rb") as f:
+        capture = f.read()
+    decode(elf, capture, sys.stdout)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,540 @@
+// SPDX-License-Identifier: GPL-2.0
+//Builds the pre-decoded asset pack read by src/id_fs_t4.cpp, so level loads on the Teensy are
+//bound by SD bandwidth instead of Huffman and Carmack/RLEW decompression. Runs on the PC.
+//
+//Build: cc -O2 -Wall -o t4pack tools/t4pack.c
+//Usage: t4pack [-lz4] [-align bytes] <game dir> <ext> [output]
+//   eg: t4pack -lz4 ~/keen4 CK4
+//
+//The game dir needs the same files omnispeak does: EGAGRAPH, EGAHEAD, EGADICT, GFXINFOE, GAMEMAPS and
+//MAPHEAD with the given extension. The output defaults to T4PACK.<ext> in the game dir; copy it to the
+//SD card next to the game files. Rebuild the pack whenever the game files change, otherwise it's ignored.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/id_fs_t4_pack.h"
+
+#define NUM_MAPS 100
+#define NUM_PLANES 3
+
+typedef struct Buffer
+{
+    uint8_t *data;
+    uint32_t size;
+} Buffer;
+
+typedef struct Entry
+{
+    T4_PackEntry e;
+    uint8_t *data;
+} Entry;
+
+static Entry *entries;
+static int num_entries, max_entries;
+
+static uint16_t rd16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t rd32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static Buffer load_file(const char *dir, const char *name, const char *ext)
+{
+    char path[1024];
+    Buffer b = {NULL, 0};
+    snprintf(path, sizeof(path), "%s/%s.%s", dir, name, ext);
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    b.size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    b.data = malloc(b.size + 1);
+    if (fread(b.data, 1, b.size, f) != b.size)
+    {
+        fprintf(stderr, "Could not read %s\n", path);
+        exit(1);
+    }
+    fclose(f);
+    return b;
+}
+
+static void add_entry(int type, int id, uint8_t *data, uint32_t size)
+{
+    if (num_entries == max_entries)
+    {
+        max_entries = max_entries ? max_entries * 2 : 1024;
+        entries = realloc(entries, max_entries * sizeof(Entry));
+    }
+    Entry *en = &entries[num_entries++];
+    memset(en, 0, sizeof(*en));
+    en->e.type = type;
+    en->e.id = id;
+    en->e.size = size;
+    en->e.expanded = size;
+    en->data = data;
+}
+
+//Same as CAL_HuffExpand in id_ca. Bits are read LSB first and node 254 is the root.
+static int huff_expand(const uint8_t *src, uint32_t src_len, uint8_t *dst, uint32_t len, const uint8_t *dict)
+{
+    int node = 254;
+    uint32_t written = 0;
+    for (uint32_t i = 0; i < src_len && written < len; i++)
+    {
+        for (int bit = 0; bit < 8 && written < len; bit++)
+        {
+            uint16_t val = rd16(&dict[node * 4 + ((src[i] >> bit) & 1) * 2]);
+            if (val < 256)
+            {
+                dst[written++] = val;
+                node = 254;
+            }
+            else
+            {
+                node = val - 256;
+            }
+        }
+    }
+    return written == len;
+}
+
+static void pack_graphics(const char *dir, const char *ext, uint32_t *graph_size)
+{
+    Buffer graph = load_file(dir, "EGAGRAPH", ext);
+    Buffer head = load_file(dir, "EGAHEAD", ext);
+    Buffer dict = load_file(dir, "EGADICT", ext);
+    Buffer info = load_file(dir, "GFXINFOE", ext);
+    *graph_size = graph.size;
+    if (dict.size < 255 * 4 || info.size < 23 * 2)
+    {
+        fprintf(stderr, "EGADICT or GFXINFOE is too short\n");
+        exit(1);
+    }
+
+    //GFXINFOE is a list of 16 bit tile counts followed by the first chunk of each tile type
+    uint16_t num_tiles[6], off_tiles[6];
+    for (int i = 0; i < 6; i++)
+    {
+        num_tiles[i] = rd16(&info.data[i * 2]);
+        off_tiles[i] = rd16(&info.data[12 + i * 2]);
+    }
+    int tiles_end = off_tiles[5] + num_tiles[5];
+
+    int num_chunks = head.size / 3;
+    int packed = 0;
+    for (int chunk = 0; chunk < num_chunks; chunk++)
+    {
+        uint32_t pos = head.data[chunk * 3] | (head.data[chunk * 3 + 1] << 8) | (head.data[chunk * 3 + 2] << 16);
+        if (pos == 0xFFFFFF)
+        {
+            continue;
+        }
+        uint32_t next = graph.size;
+        for (int n = chunk + 1; n < num_chunks; n++)
+        {
+            uint32_t p = head.data[n * 3] | (head.data[n * 3 + 1] << 8) | (head.data[n * 3 + 2] << 16);
+            if (p != 0xFFFFFF)
+            {
+                next = p;
+                break;
+            }
+        }
+        if (next <= pos || next > graph.size)
+        {
+            continue;
+        }
+
+        //Tiles have an implied length, everything else starts with its expanded length
+        const uint8_t *src = &graph.data[pos];
+        uint32_t src_len = next - pos;
+        uint32_t expanded;
+        if (chunk >= off_tiles[0] && chunk < tiles_end)
+        {
+            if (chunk < off_tiles[1])
+                expanded = 32 * num_tiles[0];
+            else if (chunk < off_tiles[2])
+                expanded = 40 * num_tiles[1];
+            else if (chunk < off_tiles[3])
+                expanded = 32 * 4;
+            else if (chunk < off_tiles[4])
+                expanded = 40 * 4;
+            else if (chunk < off_tiles[5])
+                expanded = 32 * 16;
+            else
+                expanded = 40 * 16;
+        }
+        else
+        {
+            if (src_len < 4)
+            {
+                continue;
+            }
+            expanded = rd32(src);
+            src += 4;
+            src_len -= 4;
+        }
+        if (expanded == 0 || expanded > 0x100000)
+        {
+            continue;
+        }
+
+        uint8_t *out = malloc(expanded);
+        if (!huff_expand(src, src_len, out, expanded, dict.data))
+        {
+            fprintf(stderr, "Chunk %d did not expand to %u bytes, skipping it\n", chunk, expanded);
+            free(out);
+            continue;
+        }
+        add_entry(T4_PACK_GRAPHICS, chunk, out, expanded);
+        packed++;
+    }
+    printf("Graphics: %d of %d chunks\n", packed, num_chunks);
+}
+
+//Same as CAL_CarmackExpand. len is in bytes. Near pointers (0xA7) count back from the output,
+//far pointers (0xA8) are from its start. A zero count escapes a literal word with that high byte.
+static int carmack_expand(const uint8_t *src, uint32_t src_len, uint16_t *dst, uint32_t len)
+{
+    uint32_t words = len / 2, out = 0, in = 0;
+    while (out < words)
+    {
+        if (in + 2 > src_len)
+            return 0;
+        uint16_t ch = rd16(&src[in]);
+        in += 2;
+        uint8_t high = ch >> 8, count = ch & 0xFF;
+        if ((high == 0xA7 || high == 0xA8) && count == 0)
+        {
+            if (in >= src_len)
+                return 0;
+            dst[out++] = (ch & 0xFF00) | src[in++];
+        }
+        else if (high == 0xA7)
+        {
+            if (in >= src_len)
+                return 0;
+            uint32_t offset = src[in++];
+            if (offset > out || out + count > words)
+                return 0;
+            for (int i = 0; i < count; i++, out++)
+                dst[out] = dst[out - offset];
+        }
+        else if (high == 0xA8)
+        {
+            if (in + 2 > src_len)
+                return 0;
+            uint32_t offset = rd16(&src[in]);
+            in += 2;
+            if (offset + count > out || out + count > words)
+                return 0;
+            for (int i = 0; i < count; i++, out++)
+                dst[out] = dst[offset + i];
+        }
+        else
+        {
+            dst[out++] = ch;
+        }
+    }
+    return 1;
+}
+
+//Same as CAL_RLEWExpand. len is in bytes.
+static int rlew_expand(const uint16_t *src, uint32_t src_words, uint16_t *dst, uint32_t len, uint16_t tag)
+{
+    uint32_t words = len / 2, out = 0, in = 0;
+    while (out < words && in < src_words)
+    {
+        uint16_t w = src[in++];
+        if (w != tag)
+        {
+            dst[out++] = w;
+            continue;
+        }
+        if (in + 2 > src_words)
+            return 0;
+        uint16_t count = src[in++], value = src[in++];
+        if (out + count > words)
+            return 0;
+        for (int i = 0; i < count; i++)
+            dst[out++] = value;
+    }
+    return out == words;
+}
+
+static void pack_maps(const char *dir, const char *ext, uint32_t *maps_size)
+{
+    Buffer maps = load_file(dir, "GAMEMAPS", ext);
+    Buffer head = load_file(dir, "MAPHEAD", ext);
+    *maps_size = maps.size;
+    if (head.size < 2 + NUM_MAPS * 4)
+    {
+        fprintf(stderr, "MAPHEAD is too short\n");
+        exit(1);
+    }
+    uint16_t tag = rd16(head.data);
+
+    int packed = 0;
+    for (int map = 0; map < NUM_MAPS; map++)
+    {
+        uint32_t pos = rd32(&head.data[2 + map * 4]);
+        if (pos == 0 || pos == 0xFFFFFFFF || pos + 38 > maps.size)
+        {
+            continue;
+        }
+        const uint8_t *header = &maps.data[pos];
+        uint16_t width = rd16(&header[18]), height = rd16(&header[20]);
+        uint32_t plane_size = width * height * 2;
+
+        for (int plane = 0; plane < NUM_PLANES; plane++)
+        {
+            uint32_t start = rd32(&header[plane * 4]);
+            uint16_t length = rd16(&header[12 + plane * 2]);
+            if (start + length > maps.size || length < 2)
+            {
+                fprintf(stderr, "Map %d plane %d is out of range, skipping it\n", map, plane);
+                continue;
+            }
+
+            //Carmack data starts with its expanded length, RLEW data then starts with the final length
+            uint32_t carmacked = rd16(&maps.data[start]);
+            uint16_t *rlew = malloc(carmacked + 2);
+            uint16_t *out = malloc(plane_size);
+            if (!carmack_expand(&maps.data[start + 2], length - 2, rlew, carmacked) ||
+                rlew[0] != plane_size || !rlew_expand(rlew + 1, carmacked / 2 - 1, out, plane_size, tag))
+            {
+                fprintf(stderr, "Map %d plane %d did not expand, skipping it\n", map, plane);
+                free(rlew);
+                free(out);
+                continue;
+            }
+            free(rlew);
+            add_entry(T4_PACK_MAP, map * NUM_PLANES + plane, (uint8_t *)out, plane_size);
+            packed++;
+        }
+    }
+    printf("Maps: %d planes\n", packed);
+}
+
+//LZ4 block format compressor. Greedy matching through a hash of the next 4 bytes, which is plenty
+//for data this small. Returns 0 if the result wouldn't be smaller than the input.
+static uint32_t lz4_compress(const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+    static int32_t table[1 << 14];
+    memset(table, 0xFF, sizeof(table));
+    uint32_t in = 0, anchor = 0, out = 0;
+    uint32_t limit = len > 12 ? len - 12 : 0; //The last match has to end 5 bytes before the end
+
+    while (in < limit)
+    {
+        uint32_t seq = rd32(&src[in]);
+        uint32_t h = (seq * 2654435761u) >> 18;
+        int32_t ref = table[h];
+        table[h] = in;
+        if (ref < 0 || in - ref > 0xFFFF || rd32(&src[ref]) != seq)
+        {
+            in++;
+            continue;
+        }
+
+        uint32_t match = 4;
+        while (in + match < len - 5 && src[ref + match] == src[in + match])
+            match++;
+
+        uint32_t literals = in - anchor;
+        if (out + literals + literals / 255 + 16 >= len)
+            return 0;
+        uint8_t *token = &dst[out++];
+        *token = (literals < 15 ? literals : 15) << 4;
+        if (literals >= 15)
+        {
+            uint32_t n = literals - 15;
+            for (; n >= 255; n -= 255)
+                dst[out++] = 255;
+            dst[out++] = n;
+        }
+        memcpy(&dst[out], &src[anchor], literals);
+        out += literals;
+        dst[out++] = (in - ref) & 0xFF;
+        dst[out++] = (in - ref) >> 8;
+        uint32_t m = match - 4;
+        *token |= m < 15 ? m : 15;
+        if (m >= 15)
+        {
+            m -= 15;
+            for (; m >= 255; m -= 255)
+                dst[out++] = 255;
+            dst[out++] = m;
+        }
+        in += match;
+        anchor = in;
+    }
+
+    uint32_t literals = len - anchor;
+    if (out + literals + literals / 255 + 2 >= len)
+        return 0;
+    dst[out++] = (literals < 15 ? literals : 15) << 4;
+    if (literals >= 15)
+    {
+        uint32_t n = literals - 15;
+        for (; n >= 255; n -= 255)
+            dst[out++] = 255;
+        dst[out++] = n;
+    }
+    memcpy(&dst[out], &src[anchor], literals);
+    return out + literals;
+}
+
+//Matches the decompressor in id_fs_t4.cpp, used to check every compressed entry.
+static uint32_t lz4_decompress(const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t dst_len)
+{
+    uint32_t in = 0, out = 0;
+    while (in < len)
+    {
+        uint8_t token = src[in++];
+        uint32_t n = token >> 4;
+        if (n == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (in >= len)
+                    return 0;
+                b = src[in++];
+                n += b;
+            } while (b == 255);
+        }
+        if (out + n > dst_len || in + n > len)
+            return 0;
+        memcpy(&dst[out], &src[in], n);
+        in += n;
+        out += n;
+        if (in == len)
+            break;
+        if (in + 2 > len)
+            return 0;
+
+        uint32_t offset = src[in] | (src[in + 1] << 8);
+        in += 2;
+        n = (token & 0xF) + 4;
+        if ((token & 0xF) == 15)
+        {
+            uint8_t b;
+            do
+            {
+                if (in >= len)
+                    return 0;
+                b = src[in++];
+                n += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > out || out + n > dst_len)
+            return 0;
+        for (uint32_t i = 0; i < n; i++, out++)
+            dst[out] = dst[out - offset];
+    }
+    return out;
+}
+
+int main(int argc, char **argv)
+{
+    int lz4 = 0;
+    uint32_t align = 512;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++)
+    {
+        if (strcmp(argv[arg], "-lz4") == 0)
+            lz4 = 1;
+        else if (strcmp(argv[arg], "-align") == 0 && arg + 1 < argc)
+            align = strtoul(argv[++arg], NULL, 0);
+        else
+            break;
+    }
+    if (argc - arg < 2 || align == 0 || align > 0x8000 || (align & (align - 1)))
+    {
+        fprintf(stderr, "Usage: %s [-lz4] [-align bytes] <game dir> <ext> [output]\n", argv[0]);
+        fprintf(stderr, "  -lz4     LZ4 compress entries where it helps\n");
+        fprintf(stderr, "  -align   Entry alignment, a power of 2. Default 512\n");
+        return 1;
+    }
+    const char *dir = argv[arg], *ext = argv[arg + 1];
+    char output[1024];
+    if (argc - arg > 2)
+        snprintf(output, sizeof(output), "%s", argv[arg + 2]);
+    else
+        snprintf(output, sizeof(output), "%s/T4PACK.%s", dir, ext);
+
+    T4_PackHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = T4_PACK_MAGIC;
+    header.version = T4_PACK_VERSION;
+    header.alignment = align;
+    strncpy(header.ext, ext, 3);
+    pack_graphics(dir, ext, &header.graph_size);
+    pack_maps(dir, ext, &header.maps_size);
+    header.num_entries = num_entries;
+
+    //Entries are added in type then id order, which is the order the loader searches in
+    uint32_t raw = 0, stored = 0;
+    for (int i = 0; i < num_entries; i++)
+    {
+        Entry *en = &entries[i];
+        raw += en->e.expanded;
+        if (lz4)
+        {
+            uint8_t *c = malloc(en->e.expanded + en->e.expanded / 255 + 16);
+            uint32_t size = lz4_compress(en->data, en->e.expanded, c);
+            uint8_t *check = malloc(en->e.expanded);
+            if (size && lz4_decompress(c, size, check, en->e.expanded) == en->e.expanded &&
+                memcmp(check, en->data, en->e.expanded) == 0)
+            {
+                free(en->data);
+                en->data = c;
+                en->e.size = size;
+                en->e.flags |= T4_PACK_LZ4;
+            }
+            else
+            {
+                free(c);
+            }
+            free(check);
+        }
+        stored += en->e.size;
+    }
+
+    FILE *f = fopen(output, "wb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not create %s\n", output);
+        return 1;
+    }
+    uint32_t offset = sizeof(T4_PackHeader) + num_entries * sizeof(T4_PackEntry);
+    for (int i = 0; i < num_entries; i++)
+    {
+        offset = (offset + align - 1) & ~(align - 1);
+        entries[i].e.offset = offset;
+        offset += entries[i].e.size;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    for (int i = 0; i < num_entries; i++)
+        fwrite(&entries[i].e, sizeof(T4_PackEntry), 1, f);
+    for (int i = 0; i < num_entries; i++)
+    {
+        static const uint8_t zero[0x8000];
+        long pad = entries[i].e.offset - ftell(f);
+        fwrite(zero, 1, pad, f);
+        fwrite(entries[i].data, 1, entries[i].e.size, f);
+    }
+    printf("Wrote %s: %d entries, %u bytes expanded, %u stored, %ld bytes total\n", output, num_entries, raw, stored, ftell(f));
+    fclose(f);
+    return 0;
+}
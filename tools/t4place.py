@@ -0,0 +1,204 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+"""Profile guided placement of code between ITCM and flash.
+
+By default the Teensy linker script puts all code in ITCM except FLASHMEM functions. ITCM is
+carved out of RAM1 in 32KB banks, so every bank of code is a bank less for DTCM data such as the
+front buffer. This moves the game's rarely called functions to flash and keeps the hot ones in
+ITCM, based on call counts from the teensy41_profile environment.
+
+  generate <profile elf> <capture> [options]
+      Reads the 'PROF:' lines from a Serial1 capture of the 'c' console command, picks the hot
+      functions and writes a linker script that moves the rest of the project's code to flash.
+      Build the teensy41_placed environment with it afterwards.
+  report <elf>
+      Prints the ITCM/DTCM split of any build.
+
+Only code from the project's own object files (src/ in the profile build) is moved. The Teensy
+core and libc are left in ITCM. Functions already marked FLASHMEM or FASTRUN keep their place.
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+
+BANK = 32 * 1024
+RAM1_SIZE = 512 * 1024
+DEFAULT_LDSCRIPT = os.path.expanduser(
+    "~/.platformio/packages/framework-arduinoteensy/cores/teensy4/imxrt1062_t41.ld")
+FLASH_ANCHOR = "*(.flashmem*)"
+
+
+class Elf:
+    """Sections and function symbols of an ELF32 file."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            data = f.read()
+        if data[:4] != b"\x7fELF" or data[4] != 1:
+            raise ValueError("%s is not a 32 bit ELF file" % path)
+        shoff, = struct.unpack_from("<I", data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", data, 0x2E)
+
+        headers = [struct.unpack_from("<IIIIIIIIII", data, shoff + i * shentsize) for i in range(shnum)]
+
+        def string(table, index):
+            start = headers[table][4] + index
+            return data[start:data.index(b"\0", start)].decode("latin-1")
+
+        # name, type, addr, size
+        self.sections = [(string(shstrndx, h[0]), h[1], h[3], h[5]) for h in headers]
+        # name, section index, value, size for every function symbol
+        self.functions = []
+        for h in headers:
+            if h[1] != 2:  # SHT_SYMTAB
+                continue
+            strtab = h[6]
+            for offset in range(h[4], h[4] + h[5], h[9]):
+                name, value, size, info, _, shndx = struct.unpack_from("<IIIBBH", data, offset)
+                if info & 0xF == 2 and 0 < shndx < len(headers):  # STT_FUNC, defined
+                    self.functions.append((string(strtab, name), shndx, value & ~1, size))
+
+    def section_size(self, name):
+        return sum(s[3] for s in self.sections if s[0] == name)
+
+
+def ram1_split(itcm_code):
+    banks = (itcm_code + BANK - 1) // BANK
+    return banks, RAM1_SIZE - banks * BANK
+
+
+def report(elf):
+    itcm = elf.section_size(".text.itcm") + elf.section_size(".ARM.exidx")
+    dtcm = elf.section_size(".data") + elf.section_size(".bss")
+    flash = elf.section_size(".text.code") + elf.section_size(".text.progmem")
+    banks, dtcm_size = ram1_split(itcm)
+    print("ITCM: %7d bytes of code in %d banks (%d KB)" % (itcm, banks, banks * BANK // 1024))
+    print("DTCM: %7d bytes of data, %d KB available, %d bytes left for the stack" %
+          (dtcm, dtcm_size // 1024, dtcm_size - dtcm))
+    print("FLASH: %6d bytes of code run from flash" % flash)
+
+
+def read_profile(path):
+    counts = {}
+    with open(path, "r", errors="replace") as f:
+        for line in f:
+            m = re.search(r"PROF: ([0-9a-fA-F]{8}) (\d+)", line)
+            if m:
+                fn = int(m.group(1), 16) & ~1
+                counts[fn] = counts.get(fn, 0) + int(m.group(2))
+    return counts
+
+
+def project_sections(objdir):
+    """Maps function name to a list of (pattern, section, size) from the project objects."""
+    functions = {}
+    for root, _, files in os.walk(objdir):
+        for name in files:
+            if not name.endswith(".o"):
+                continue
+            path = os.path.join(root, name)
+            obj = Elf(path)
+            pattern = "*/" + os.path.relpath(path, objdir).replace(os.sep, "/")
+            for fn, shndx, _, _ in obj.functions:
+                section, _, _, size = obj.sections[shndx]
+                functions.setdefault(fn, []).append((pattern, section, size))
+    return functions
+
+
+def generate(args):
+    elf = Elf(args.elf)
+    counts = read_profile(args.capture)
+    if not counts:
+        sys.exit("%s has no PROF: lines. Send 'c' on the console of a teensy41_profile build." % args.capture)
+    objdir = args.objdir or os.path.join(os.path.dirname(args.elf), "src")
+    functions = project_sections(objdir)
+
+    by_address = {}
+    for fn, _, value, _ in elf.functions:
+        by_address.setdefault(value, fn)
+
+    # Most called first, until the coverage target or the ITCM budget is reached
+    profile = sorted(((count, by_address.get(addr, "0x%08x" % addr)) for addr, count in counts.items()), reverse=True)
+    total = sum(count for count, _ in profile)
+    hot = set()
+    hot_flashmem = []
+    covered = 0
+    used = 0
+    for count, fn in profile:
+        if covered >= total * args.coverage:
+            break
+        secs = functions.get(fn, [])
+        if any(s[1].startswith(".flashmem") for s in secs):
+            hot_flashmem.append((count, fn))
+        size = sum(s[2] for s in secs if s[1].startswith(".text"))
+        if used + size > args.itcm_budget:
+            continue
+        hot.add(fn)
+        used += size
+        covered += count
+
+    cold = []
+    cold_bytes = 0
+    for fn, secs in functions.items():
+        if fn in hot:
+            continue
+        for pattern, section, size in secs:
+            # .text.startup and friends are moved too. .fastrun and .flashmem are left alone.
+            if section.startswith(".text."):
+                cold.append("%s(%s)" % (pattern, section))
+                cold_bytes += size
+    cold = sorted(set(cold))
+
+    with open(args.ldscript, "r") as f:
+        script = f.read()
+    if FLASH_ANCHOR not in script:
+        sys.exit("%s has no %s to add the cold code after" % (args.ldscript, FLASH_ANCHOR))
+    fragment = FLASH_ANCHOR + "\n\t\t/* Cold code, generated by tools/t4place.py */" + \
+        "".join("\n\t\t%s" % c for c in cold)
+    script = script.replace(FLASH_ANCHOR, fragment, 1)
+    with open(args.output, "w") as f:
+        f.write(script)
+
+    print("%d of %d called functions kept in ITCM (%d bytes), covering %.3f%% of %d calls" %
+          (len(hot), len(profile), used, covered * 100.0 / total, total))
+    print("%d sections (%d bytes) moved to flash, written to %s" % (len(cold), cold_bytes, args.output))
+    for count, fn in hot_flashmem:
+        print("Warning: %s is marked FLASHMEM but was called %d times" % (fn, count))
+
+    itcm = elf.section_size(".text.itcm") + elf.section_size(".ARM.exidx")
+    before, _ = ram1_split(itcm)
+    after, dtcm_size = ram1_split(max(itcm - cold_bytes, 0))
+    print("Estimated ITCM %d -> %d banks, DTCM %d KB available. The instrumented sizes are larger than a"
+          " normal build, so run 'report' on the teensy41_placed build for the real split." %
+          (before, after, dtcm_size // 1024))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    gen = sub.add_parser("generate")
+    gen.add_argument("elf", help="firmware.elf from the teensy41_profile build")
+    gen.add_argument("capture", help="Serial1 capture holding the 'c' console output")
+    gen.add_argument("--objdir", help="Project object files, default <elf dir>/src")
+    gen.add_argument("--ldscript", default=DEFAULT_LDSCRIPT, help="Teensy linker script to start from")
+    gen.add_argument("--output", "-o", default="placement.ld")
+    gen.add_argument("--coverage", type=float, default=0.999, help="Fraction of calls to keep in ITCM")
+    gen.add_argument("--itcm-budget", type=int, default=96 * 1024, help="Most bytes of project code in ITCM")
+
+    rep = sub.add_parser("report")
+    rep.add_argument("elf")
+
+    args = parser.parse_args()
+    if args.command == "report":
+        report(Elf(args.elf))
+    else:
+        generate(args)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0
+"""Decodes a flight recorder dump from src/id_rec_t4.cpp.
+
+Usage: t4rec.py <T4REC.BIN or Serial1 capture> [--summary]
+
+The input is either T4REC.BIN from the SD card, or a Serial1 capture holding the 'REC:' lines the
+Teensy streams after booting (or after 'r' on the console). The events are printed oldest first,
+followed by a summary of frame times.
+"""
+
+import struct
+import sys
+
+MAGIC = 0x43523454
+VERSION = 1
+HEADER = struct.Struct("<IHHIII12x")
+EVENT = struct.Struct("<IBBHII")
+
+TYPES = {1: "boot", 2: "frame", 3: "alloc", 4: "free", 5: "fs open", 6: "fs read", 7: "FATAL", 8: "STALL"}
+TAGS = ["surface", "mm", "userfile", "cache", "draw", "capture"]
+REGIONS = ["RAM1", "RAM2", "EXTMEM", "OTHER"]
+FATALS = {1: "surface allocation failed"}
+# SRC_SRSR bits
+RESET_REASONS = [(0, "power on"), (3, "lockup"), (4, "CPU reset"), (5, "watchdog"), (6, "JTAG"),
+                 (7, "watchdog 3"), (8, "temperature"), (16, "watchdog 2")]
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) >= 4 and struct.unpack_from("<I", data)[0] == MAGIC:
+        return data
+    # Serial1 capture, possibly with other output mixed in. Only the last dump is used.
+    dumps = [bytearray()]
+    for line in data.decode("latin-1").splitlines():
+        line = line.strip()
+        if not line.startswith("REC: "):
+            continue
+        payload = line[5:]
+        if payload == "end":
+            dumps.append(bytearray())
+        else:
+            try:
+                dumps[-1] += bytes.fromhex(payload)
+            except ValueError:
+                pass
+    complete = [d for d in dumps if len(d) >= HEADER.size]
+    if not complete:
+        sys.exit("%s holds no flight recorder dump" % path)
+    return bytes(complete[-1])
+
+
+def describe(kind, arg, a, b):
+    if kind == 1:
+        reasons = [name for bit, name in RESET_REASONS if a & (1 << bit)]
+        return "boot %d, reset reason 0x%x (%s)" % (b, a, ", ".join(reasons) or "unknown")
+    if kind == 2:
+        return "%7.2f ms since last, present %5d us, waited %5d us, OPL queue %d" % (
+            a / 1000.0, b & 0xFFFF, b >> 16, arg)
+    if kind in (3, 4):
+        tag = TAGS[arg & 0xFF] if (arg & 0xFF) < len(TAGS) else str(arg & 0xFF)
+        region = REGIONS[arg >> 8] if (arg >> 8) < len(REGIONS) else str(arg >> 8)
+        return "%-8s %-6s %8d bytes at 0x%08x" % (tag, region, a, b)
+    if kind == 5:
+        return "handle %d %s" % (arg, struct.pack("<II", a, b).split(b"\0")[0].decode("latin-1"))
+    if kind == 6:
+        return "handle %d, %d bytes in %d us" % (arg, a, b)
+    if kind == 7:
+        return "%s (%d)" % (FATALS.get(arg, "code %d" % arg), a)
+    if kind == 8:
+        return "no frame for %d ms after %d frames" % (a, b)
+    return "arg %d a 0x%08x b 0x%08x" % (arg, a, b)
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.stderr.write(__doc__)
+        return 1
+    data = load(sys.argv[1])
+    summary_only = "--summary" in sys.argv[2:]
+
+    magic, version, event_size, num_events, head, boot = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or event_size != EVENT.size:
+        sys.exit("Unsupported dump (magic 0x%08x, version %d, event size %d)" % (magic, version, event_size))
+    if len(data) < HEADER.size + num_events * EVENT.size:
+        sys.exit("Dump is truncated")
+    print("Boot %d, %d events recorded, ring holds %d" % (boot, head, num_events))
+
+    first = max(0, head - num_events)
+    frames = []
+    skipped = 0
+    last = None
+    for i in range(first, head):
+        offset = HEADER.size + (i % num_events) * EVENT.size
+        raw = data[offset:offset + EVENT.size]
+        if sum(raw) & 0xFF != 0xA5:
+            skipped += 1
+            continue
+        ms, kind, _, arg, a, b = EVENT.unpack(raw)
+        last = (ms, kind, arg, a, b)
+        if kind == 2 and a:
+            frames.append(a)
+        if not summary_only:
+            print("[%9.3f] %-8s %s" % (ms / 1000.0, TYPES.get(kind, "type %d" % kind), describe(kind, arg, a, b)))
+
+    if skipped:
+        print("%d damaged events skipped" % skipped)
+    if frames:
+        frames.sort()
+        print("Frames: %d, average %.2f ms, median %.2f ms, 99th percentile %.2f ms, worst %.2f ms" % (
+            len(frames), sum(frames) / len(frames) / 1000.0, frames[len(frames) // 2] / 1000.0,
+            frames[min(len(frames) - 1, len(frames) * 99 // 100)] / 1000.0, frames[-1] / 1000.0))
+    if last:
+        ms, kind, arg, a, b = last
+        print("Last event at %.3f s: %s %s" % (ms / 1000.0, TYPES.get(kind, "type %d" % kind), describe(kind, arg, a, b)))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())